@@ -19,9 +19,11 @@
 #include <stdint.h>
 #include <cstdlib>
 #include <cstring>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 #define PAGE_SHIFT 12
 #define PAGE_SIZE ( 1UL << PAGE_SHIFT )
@@ -127,16 +129,25 @@ struct EmulatorContext {
 		address_ = 0;
 		size_    = 0;
 		memset( data_, 0, sizeof( data_ ) );
+		insnSize_ = 0;
+		memset( insn_, 0, sizeof( insn_ ) );
 	}
 
 	uint64_t address_{};
 	uint32_t size_{};
 	uint8_t  data_[164]{};
+
+	// Bytes of the faulting instruction, if the handler has already read them. When set on an
+	// emulated EPT violation, the hypervisor decodes these instead of fetching from guest memory,
+	// so insn_ must hold the whole instruction.
+	uint32_t insnSize_{};
+	uint8_t  insn_[16]{};
 };
 
 enum MapReturnCode { MAP_SUCCESS, MAP_FAILED_GENERIC, MAP_PAGE_NOT_PRESENT, MAP_INVALID_PARAMETER };
 
 class EventHandler;
+class MemAccessTable;
 
 class Driver {
 
@@ -147,14 +158,13 @@ public:
 	using ViewConvertibleMap = std::unordered_map<uint16_t, ConvertibleMap>;
 	using MemAccessMap       = std::unordered_map<uint64_t, uint8_t>;
 	using ViewMemAccessMap   = std::unordered_map<uint16_t, MemAccessMap>;
+	using PageClassMap       = std::unordered_map<unsigned int, std::vector<uint64_t>>;
 
 public:
-	Driver( EventHandler *handler = nullptr ) : handler_{ handler }
-	{
-	}
+	Driver( EventHandler *handler = nullptr );
 
 	// base class => virtual destructor
-	virtual ~Driver() = default;
+	virtual ~Driver();
 
 public:
 	void handler( EventHandler *h )
@@ -181,13 +191,23 @@ public:
 	bool setPageProtection( unsigned long long guestAddress, bool read, bool write, bool execute,
 	                        unsigned short view = 0 );
 
-	// Get guest page protection (_NOT_ virtual)
+	// Get guest page protection (_NOT_ virtual, lock-free when the page is cached)
 	bool getPageProtection( unsigned long long guestAddress, bool &read, bool &write, bool &execute,
 	                        unsigned short view = 0 );
 
 	// Flush page protections (_NOT_ virtual)
 	void flushPageProtections();
 
+	// Group gfns under classId (replacing any previous group with that id) (_NOT_ virtual)
+	void registerPageClass( unsigned int classId, const std::vector<unsigned long long> &gfns );
+
+	// Forget about a page class (_NOT_ virtual)
+	bool unregisterPageClass( unsigned int classId );
+
+	// Set protection for every page in the class, delayed until the next flush (_NOT_ virtual)
+	bool setClassProtection( unsigned int classId, bool read, bool write, bool execute,
+	                         unsigned short view = 0 );
+
 	// Get registers
 	virtual bool registers( unsigned short vcpu, Registers &regs ) const = 0;
 
@@ -275,14 +295,22 @@ private:
 	                                    unsigned short view ) = 0;
 
 private:
-	EventHandler *     handler_{ nullptr };
-	ViewMemAccessMap   memAccessCache_;
-	ViewMemAccessMap   delayedMemAccessWrite_;
-	ViewConvertibleMap delayedConvertibleWrite_;
-	std::mutex         memAccessCacheMutex_;
-	std::mutex         convertibleCacheMutex_;
+	// flushPageProtections() with flushMutex_ already held
+	void flushPageProtectionsLocked();
+
+private:
+	EventHandler *                  handler_{ nullptr };
+	std::unique_ptr<MemAccessTable> memAccessCache_;
+	ViewMemAccessMap                delayedMemAccessWrite_;
+	ViewConvertibleMap              delayedConvertibleWrite_;
+	std::mutex                      delayedMemAccessMutex_;
+	std::mutex                      convertibleCacheMutex_;
+	std::mutex                      flushMutex_;
+	PageClassMap                    pageClasses_;
+	std::mutex                      pageClassMutex_;
 
 	friend class PageCache;
+	friend class ProtectionTransaction;
 };
 
 } // namespace bdvmi
@@ -0,0 +1,64 @@
+// Copyright (c) 2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIEVENT_H_INCLUDED__
+#define __BDVMIEVENT_H_INCLUDED__
+
+#include "driver.h"
+#include "eventhandler.h"
+#include <stdint.h>
+
+namespace bdvmi {
+
+class RegisterView;
+
+// One event, as handed to EventHandler::handleEvents(). Only the fields for its type are set.
+struct Event {
+	unsigned int        type{ 0 }; // a single BDVMI_EVENT_* bit
+	unsigned short      vcpu{ 0 };
+	const RegisterView *regs{ nullptr }; // valid until handleEvents() returns
+
+	// BDVMI_EVENT_CR, BDVMI_EVENT_MSR
+	unsigned short crNumber{ 0 };
+	uint32_t       msr{ 0 };
+	uint64_t       oldValue{ 0 };
+	uint64_t       newValue{ 0 };
+
+	// BDVMI_EVENT_PAGE_FAULT, BDVMI_EVENT_BREAKPOINT (physAddress only)
+	uint64_t physAddress{ 0 };
+	uint64_t virtAddress{ 0 };
+	bool     read{ false };
+	bool     write{ false };
+	bool     execute{ false };
+	bool     inGpt{ false };
+
+	// BDVMI_EVENT_INTERRUPT
+	uint32_t vector{ 0 };
+	uint64_t errorCode{ 0 };
+	uint64_t cr2{ 0 };
+
+	// BDVMI_EVENT_DESCRIPTOR (BDVMI_DESC_ACCESS_* bits)
+	unsigned int descriptorFlags{ 0 };
+
+	// Set by the handler, same meaning as the single event callbacks' out parameters
+	HVAction        action{ NONE };
+	EmulatorContext emulatorCtx;
+	unsigned short  instructionSize{ 0 };
+	bool            reinject{ false }; // breakpoints only
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIEVENT_H_INCLUDED__
@@ -16,15 +16,20 @@
 #ifndef __BDVMIEVENTHANDLER_H_INCLUDED__
 #define __BDVMIEVENTHANDLER_H_INCLUDED__
 
+#include <stddef.h>
 #include <stdint.h>
 
 namespace bdvmi {
 
 // Forward declaration
 class Registers;
+class RegisterView;
 class EmulatorContext;
+struct Event;
 
-enum HVAction { NONE, EMULATE_NOWRITE, SKIP_INSTRUCTION, ALLOW_VIRTUAL, EMULATE_SET_CTXT };
+// ALLOW_SINGLESTEP (EPT violations only): let the instruction run unemulated by single-stepping it in a
+// view with no restrictions, then switch back. Needs altp2m, without it the instruction gets emulated.
+enum HVAction { NONE, EMULATE_NOWRITE, SKIP_INSTRUCTION, ALLOW_VIRTUAL, EMULATE_SET_CTXT, ALLOW_SINGLESTEP };
 
 enum GuestState { RUNNING, POST_SHUTDOWN, SHUTDOWN_IN_PROGRESS };
 
@@ -35,6 +40,20 @@ enum GuestState { RUNNING, POST_SHUTDOWN, SHUTDOWN_IN_PROGRESS };
 #define BDVMI_DESC_ACCESS_READ  0x10
 #define BDVMI_DESC_ACCESS_WRITE 0x20
 
+// EventHandler::handledEvents() bits
+#define BDVMI_EVENT_CR          0x0001
+#define BDVMI_EVENT_MSR         0x0002
+#define BDVMI_EVENT_PAGE_FAULT  0x0004
+#define BDVMI_EVENT_VMCALL      0x0008
+#define BDVMI_EVENT_XSETBV      0x0010
+#define BDVMI_EVENT_BREAKPOINT  0x0020
+#define BDVMI_EVENT_INTERRUPT   0x0040
+#define BDVMI_EVENT_DESCRIPTOR  0x0080
+#define BDVMI_EVENT_HOT_PAGE    0x0100
+#define BDVMI_EVENT_PRE_POST    0x0200 // runPreEvent() / runPostEvent()
+#define BDVMI_EVENT_ALL         0x03ff
+#define BDVMI_EVENT_BATCH       0x0400 // not in BDVMI_EVENT_ALL, see handleEvents()
+
 class EventHandler {
 
 public:
@@ -71,6 +90,35 @@ public:
 	                                     unsigned int flags, unsigned short &instructionLength,
 					     HVAction &action ) = 0;
 
+	// Lazy register variants of the callbacks above. These are the ones the library actually calls;
+	// by default they build the full Registers object and forward to the const Registers & versions.
+	// Override them instead if only a few registers (e.g. rip, cr3) are needed. They have names of
+	// their own so that overriding one flavour doesn't hide the other.
+	virtual void handleCRView( unsigned short vcpu, unsigned short crNumber, const RegisterView &regs,
+	                           uint64_t oldValue, uint64_t newValue, HVAction &action );
+
+	virtual void handlePageFaultView( unsigned short vcpu, const RegisterView &regs, uint64_t physAddress,
+	                                  uint64_t virtAddress, bool read, bool write, bool execute, bool inGpt,
+	                                  HVAction &action, EmulatorContext &emulatorCtx,
+	                                  unsigned short &instructionSize );
+
+	virtual void handleVMCALLView( unsigned short vcpu, const RegisterView &regs );
+
+	virtual bool handleBreakpointView( unsigned short vcpu, const RegisterView &regs, uint64_t gpa );
+
+	virtual void handleInterruptView( unsigned short vcpu, const RegisterView &regs, uint32_t vector,
+	                                  uint64_t errorCode, uint64_t cr2 );
+
+	virtual void handleDescriptorAccessView( unsigned short vcpu, const RegisterView &regs, unsigned int flags,
+	                                         unsigned short &instructionLength, HVAction &action );
+
+	// A page is causing more EPT violations / second than EventManager::setHotPageThreshold() allows.
+	// relax comes in set to the autoRelax setting, if it's true on return the violated rights are granted.
+	virtual void handleHotPage( unsigned short /* vcpu */, uint64_t /* physAddress */, unsigned short /* view */,
+	                            uint64_t /* violationsPerSecond */, bool & /* relax */ )
+	{
+	}
+
 	// Notice that the connection to the guest has been terminated (if guestStillRunning is true
 	// then this has _not_ happened because the guest shut down or has been forcefully terminated).
 	virtual void handleSessionOver( GuestState state ) = 0;
@@ -81,6 +129,21 @@ public:
 	virtual void runPreEvent() = 0;
 
 	virtual void runPostEvent() = 0;
+
+	// Batched delivery, used instead of the single event callbacks if handledEvents() includes
+	// BDVMI_EVENT_BATCH: everything pending on the ring at once, with one runPreEvent() /
+	// runPostEvent() around the whole batch. Responses can't be deferred from here.
+	virtual void handleEvents( Event *events, size_t count );
+
+	// Deliver one event to the single event callback for its type
+	void handleEvent( Event &event );
+
+	// The callbacks that actually do something (BDVMI_EVENT_* bits), queried once when the handler
+	// is set. The others are never called: those events get the response they'd get with no handler.
+	virtual unsigned int handledEvents() const
+	{
+		return BDVMI_EVENT_ALL;
+	}
 };
 
 } // namespace bdvmi
@@ -16,17 +16,58 @@
 #ifndef __BDVMIEVENTMANAGER_H_INCLUDED__
 #define __BDVMIEVENTMANAGER_H_INCLUDED__
 
+#include "eventhandler.h"
 #include <signal.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <set>
+#include <stdint.h>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 namespace bdvmi {
 
-// forward declaration, minimize compile-time file dependencies
-class EventHandler;
-
 class EventManager {
 
+public:
+	struct HotPageInfo {
+		unsigned short     view{ 0 };
+		unsigned long long gfn{ 0 };
+		uint64_t           rate{ 0 };  // EPT violations / second
+		uint64_t           total{ 0 }; // EPT violations since first seen
+		bool               relaxed{ false };
+	};
+
+	// Events matching a filter get the filter's action as their response, without the handler ever
+	// seeing them. All conditions must hold; the defaults match anything.
+	struct EventFilter {
+		unsigned int       events{ 0 }; // the BDVMI_EVENT_* kinds the filter applies to
+		int                vcpu{ -1 };  // -1: any vcpu
+		int64_t            index{ -1 }; // CR number, MSR or interrupt vector, -1: any
+		unsigned long long gfnFirst{ 0 }; // page faults and breakpoints, inclusive range
+		unsigned long long gfnLast{ ~0ULL };
+		uint64_t           ripFirst{ 0 }; // inclusive range
+		uint64_t           ripLast{ ~0ULL };
+		uint64_t           valueMask{ 0 }; // CR / MSR writes: ( newValue & valueMask ) == valueMatch
+		uint64_t           valueMatch{ 0 };
+		uint64_t           watchedBits{ 0 }; // CR / MSR writes: none of these bits changed
+		unsigned int       access{ 0 };      // page faults: no other rights than these Driver::PAGE_* were violated
+		HVAction           action{ NONE };
+	};
+
+	struct BusyPollStats {
+		uint64_t spins{ 0 };    // times the loop spun waiting for more requests
+		uint64_t spinHits{ 0 }; // ... and requests did show up before the budget ran out
+		uint64_t sleeps{ 0 };   // times the loop blocked in poll()
+	};
+
+	// Identifies a response put off with deferResponse()
+	using ResponseToken = uint64_t;
+
 public:
 	EventManager( sig_atomic_t &sigStop );
 
@@ -37,7 +78,8 @@ public:
 	// Set the handler
 	void handler( EventHandler *handler )
 	{
-		handler_ = handler;
+		handledEvents_ = handler ? handler->handledEvents() : 0;
+		handler_       = handler;
 	}
 
 	// Get the handler
@@ -52,6 +94,12 @@ public:
 
 	bool enableCrEvents( unsigned int cr );
 
+	// Only report writes to cr that change at least one of watchedBits (0 means all of them). With sync,
+	// the vcpu waits for the response (otherwise there's nothing to deny); with onChangeOnly, writes of the
+	// value already in the register aren't reported. If CR events are already enabled for cr they get
+	// disabled first, so writes in between are missed; should enabling fail then, they stay disabled.
+	bool enableCrEvents( unsigned int cr, uint64_t watchedBits, bool sync = true, bool onChangeOnly = true );
+
 	bool disableCrEvents( unsigned int cr );
 
 	bool enableXSETBVEvents();
@@ -70,6 +118,14 @@ public:
 
 	bool disableDescriptorEvents();
 
+	// Have the vcpu carry on without waiting for us on these kinds of events (BDVMI_EVENT_CR,
+	// BDVMI_EVENT_XSETBV, BDVMI_EVENT_MSR, BDVMI_EVENT_VMCALL). The handler still sees them, but
+	// can't deny or change anything. Applies to events enabled after the call.
+	void setAsyncEvents( unsigned int events )
+	{
+		asyncEvents_ = events;
+	}
+
 	// Loop waiting for events
 	virtual void waitForEvents() = 0;
 
@@ -79,6 +135,125 @@ public:
 	// Get the domain UUID
 	virtual std::string uuid() = 0;
 
+	// For serving several event managers from a few threads (see EventReactor) instead of calling
+	// waitForEvents(): the file descriptors that become readable when there's something to do ...
+	virtual std::vector<int> descriptors() const
+	{
+		return std::vector<int>();
+	}
+
+	// ... and handling whatever is pending, without blocking. Returns false once the event manager
+	// has stopped (when waitForEvents() would have returned). Never call it concurrently with itself.
+	virtual bool processEvents()
+	{
+		return false;
+	}
+
+	// Respond to up to maxBatch events before notifying the hypervisor, but never hold a response
+	// back for longer than maxLatencyUs (0: until the ring is drained). maxBatch <= 1 restores one
+	// notification per event.
+	virtual bool setEventBatching( unsigned int /* maxBatch */, unsigned int /* maxLatencyUs */ )
+	{
+		return false;
+	}
+
+	// Handle events on this many threads (<= 1: on the waitForEvents() thread). Events from the same
+	// vcpu are always handled in order, on the same thread; events from different vcpus run
+	// concurrently, so the handler must be thread-safe. Call before waitForEvents().
+	virtual bool setParallelDispatch( unsigned int /* workers */ )
+	{
+		return false;
+	}
+
+	// Only valid from inside an EventHandler callback, for the vcpu of the event being handled:
+	// don't respond to this event when the callback returns, keep the vcpu paused instead (other
+	// vcpus' events are still handled). Whatever action the callback sets is then ignored; the
+	// response goes out when completeResponse() is called with the token, from any thread.
+	virtual bool deferResponse( unsigned short /* vcpu */, ResponseToken & /* token */ )
+	{
+		return false;
+	}
+
+	// Respond to a deferred event as if the callback had set these action / emulatorCtx /
+	// instructionSize values. Each token can only be completed once.
+	virtual bool completeResponse( ResponseToken /* token */, HVAction /* action */,
+	                               const EmulatorContext * /* emulatorCtx */ = nullptr,
+	                               unsigned short /* instructionSize */ = 0 )
+	{
+		return false;
+	}
+
+	// Gets the time it should be done by, returns false to be removed
+	using TimerCallback = std::function<bool( std::chrono::steady_clock::time_point deadline )>;
+
+	// Run callback on the event thread every period, between event batches, giving it up to budget each
+	// time. Pending timers are put off while there are requests on the ring. Returns the timer id, 0 on error.
+	virtual unsigned int addTimer( std::chrono::milliseconds /* period */, std::chrono::microseconds /* budget */,
+	                               TimerCallback /* callback */ )
+	{
+		return 0;
+	}
+
+	virtual bool removeTimer( unsigned int /* id */ )
+	{
+		return false;
+	}
+
+	// After handling a batch of events, spin for up to spinUs microseconds waiting for the next one
+	// before blocking in poll(). Saves the wakeup latency at the price of CPU time; 0 disables it.
+	virtual bool setBusyPoll( unsigned int /* spinUs */ )
+	{
+		return false;
+	}
+
+	virtual BusyPollStats busyPollStats() const
+	{
+		return BusyPollStats();
+	}
+
+	// Filters are tried in the order they were added. Returns the id of the new filter, 0 on error.
+	unsigned int addEventFilter( const EventFilter &filter );
+
+	bool removeEventFilter( unsigned int id );
+
+	void clearEventFilters();
+
+	// How many events the filter has answered so far
+	bool eventFilterHits( unsigned int id, uint64_t &hits ) const;
+
+	// Report pages that cause more than violationsPerSecond EPT violations to
+	// EventHandler::handleHotPage(). If autoRelax is set, the offending rights
+	// are granted on the page by default (the handler can veto that). 0 disables tracking.
+	void setHotPageThreshold( uint64_t violationsPerSecond, bool autoRelax = false );
+
+	// The count pages with the highest violation rate, hottest first
+	std::vector<HotPageInfo> hotPages( size_t count ) const;
+
+protected:
+	// The handler, if it cares about any of the BDVMI_EVENT_* kinds in events
+	EventHandler *handlerFor( unsigned int events ) const
+	{
+		return ( handledEvents_ & events ) ? handler_ : nullptr;
+	}
+
+	// True if a filter matches, in which case event.action has been set to the filter's action
+	bool filterEvent( Event &event );
+
+	// Account for an EPT violation, returns true (once per window) when the page crosses the threshold
+	bool trackHotPage( unsigned short view, uint64_t gfn, uint64_t &rate );
+
+	void markHotPageRelaxed( unsigned short view, uint64_t gfn );
+
+	bool hotPageAutoRelax() const
+	{
+		return hotPageAutoRelax_;
+	}
+
+	bool asyncEvents( unsigned int events ) const
+	{
+		return ( asyncEvents_ & events ) != 0;
+	}
+
 private:
 	virtual bool enableMsrEventsImpl( unsigned int msr ) = 0;
 
@@ -88,6 +263,12 @@ private:
 
 	virtual bool disableCrEventsImpl( unsigned int cr ) = 0;
 
+	virtual bool enableCrEventsImpl( unsigned int /* cr */, uint64_t /* watchedBits */, bool /* sync */,
+	                                 bool /* onChangeOnly */ )
+	{
+		return false;
+	}
+
 	virtual bool enableXSETBVEventsImpl() = 0;
 
 	virtual bool disableXSETBVEventsImpl() = 0;
@@ -115,8 +296,45 @@ protected:
 	std::set<unsigned int> enabledCrs_;
 	std::set<unsigned int> enabledMsrs_;
 
+private:
+	using Clock = std::chrono::steady_clock;
+
+	struct HotPageEntry {
+		Clock::time_point windowStart;
+		uint64_t          windowCount{ 0 };
+		uint64_t          lastRate{ 0 };
+		uint64_t          total{ 0 };
+		bool              reported{ false };
+		bool              relaxed{ false };
+	};
+
+	static constexpr size_t MAX_HOT_PAGE_ENTRIES = 65536;
+
+	void pruneHotPages( Clock::time_point now );
+
+	struct FilterEntry {
+		unsigned int                           id{ 0 };
+		EventFilter                            filter;
+		std::shared_ptr<std::atomic<uint64_t>> hits;
+	};
+
+	using FilterList = std::vector<FilterEntry>;
+
+	// Copy-on-write, so the event loop doesn't need to lock anything
+	void publishFilters( std::shared_ptr<const FilterList> filters );
+
 private:
 	EventHandler *handler_{ nullptr };
+	unsigned int  handledEvents_{ 0 };
+	std::atomic<unsigned int> asyncEvents_{ 0 };
+	std::atomic<uint64_t> hotPageThreshold_{ 0 };
+	std::atomic<bool>     hotPageAutoRelax_{ false };
+	mutable std::mutex    hotPagesMutex_;
+	std::unordered_map<uint64_t, HotPageEntry> hotPages_;
+	std::shared_ptr<const FilterList> filters_; // only accessed with std::atomic_load() / std::atomic_store()
+	std::atomic<unsigned int>         filteredEvents_{ 0 };
+	unsigned int                      lastFilterId_{ 0 };
+	mutable std::mutex                filtersMutex_; // serializes the writers
 	bool          breakpointEnabled_{ false };
 	bool          xsetbvEnabled_{ false };
 	bool          vmcallEnabled_{ false };
@@ -0,0 +1,109 @@
+// Copyright (c) 2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIEVENTREACTOR_H_INCLUDED__
+#define __BDVMIEVENTREACTOR_H_INCLUDED__
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+namespace bdvmi {
+
+class EventManager;
+
+//
+// Serves the events of any number of EventManagers (typically one per guest) from
+// one epoll set and a small pool of threads, instead of a blocking waitForEvents()
+// thread per domain. An event manager is only ever served by one thread at a time,
+// but different event managers run concurrently if there's more than one thread.
+// The reactor doesn't own the event managers.
+//
+class EventReactor {
+
+public:
+	// Called (on a reactor thread) for an event manager that has stopped and has been
+	// taken off the reactor. It's safe to destroy the event manager from here.
+	using StoppedCallback = std::function<void( EventManager * )>;
+
+public:
+	explicit EventReactor( unsigned int threads = 1 );
+
+	// run() must have returned by now
+	~EventReactor();
+
+public:
+	// Start serving em's events, also fine while run() is going
+	bool add( EventManager *em );
+
+	// Stop serving em's events. Waits for a processEvents() call in progress, em can be
+	// destroyed once this returns.
+	bool remove( EventManager *em );
+
+	void onStopped( StoppedCallback callback )
+	{
+		onStopped_ = std::move( callback );
+	}
+
+	// Serve events on the calling thread plus threads - 1 others, until stop()
+	void run();
+
+	// Make run() return, callable from any thread
+	void stop();
+
+	size_t size() const;
+
+public:
+	EventReactor( const EventReactor & ) = delete;
+	EventReactor &operator=( const EventReactor & ) = delete;
+
+private:
+	struct Entry;
+
+private:
+	void serve( bool sweeper );
+
+	std::shared_ptr<Entry> find( uint64_t id ) const;
+
+	// Let em handle what's pending, then re-arm its descriptors. With wait == false, give up
+	// if another thread is already at it.
+	void service( const std::shared_ptr<Entry> &entry, bool wait );
+
+	// Call each event manager at least every so often, as the old poll() timeout did
+	void sweep();
+
+	// entry->mutex must be held
+	void detach( Entry &entry );
+
+	bool arm( const Entry &entry, int op );
+
+private:
+	unsigned int      threads_;
+	int               epollFd_{ -1 };
+	int               wakeFd_{ -1 };
+	std::atomic<bool> stop_{ false };
+	StoppedCallback   onStopped_;
+	uint64_t          lastId_{ 0 };
+	mutable std::mutex entriesMutex_;
+	std::unordered_map<uint64_t, std::shared_ptr<Entry>> entries_;
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIEVENTREACTOR_H_INCLUDED__
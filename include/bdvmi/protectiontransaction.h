@@ -0,0 +1,91 @@
+// Copyright (c) 2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIPROTECTIONTRANSACTION_H_INCLUDED__
+#define __BDVMIPROTECTIONTRANSACTION_H_INCLUDED__
+
+#include "driver.h"
+#include <vector>
+
+namespace bdvmi {
+
+//
+// Stages page protection changes across any number of views and applies them
+// all at once. commit() issues one batched call per view; if the hypervisor
+// rejects part of it, the pages that did get changed are put back to the rights
+// they had before the commit, and failures() says which gfn ranges were refused.
+// After a successful commit(), rollback() restores the prior rights.
+//
+class ProtectionTransaction {
+
+public:
+	struct Failure {
+		unsigned short     view{ 0 };
+		unsigned long long gfn{ 0 };   // first gfn of the range
+		unsigned long long count{ 0 }; // number of contiguous pages
+		int                error{ 0 }; // errno
+	};
+
+public:
+	ProtectionTransaction( Driver &driver );
+
+	// Uncommitted changes are simply discarded
+	~ProtectionTransaction() = default;
+
+public:
+	// Stage a change, nothing reaches the hypervisor before commit()
+	bool setPageProtection( unsigned long long guestAddress, bool read, bool write, bool execute,
+	                        unsigned short view = 0 );
+
+	// All or nothing: false means no page has been left changed
+	bool commit();
+
+	// Restore the rights recorded by the last successful commit()
+	bool rollback();
+
+	// Drop everything staged or recorded so far
+	void clear();
+
+	size_t size() const;
+
+	const std::vector<Failure> &failures() const
+	{
+		return failures_;
+	}
+
+public:
+	ProtectionTransaction( const ProtectionTransaction & ) = delete;
+	ProtectionTransaction &operator=( const ProtectionTransaction & ) = delete;
+
+private:
+	bool apply( const Driver::ViewMemAccessMap &changes, Driver::ViewMemAccessMap &applied,
+	            std::vector<Failure> &failures );
+
+	bool applyRuns( const Driver::MemAccessMap &changes, unsigned short view, Driver::MemAccessMap &applied,
+	                std::vector<Failure> &failures );
+
+	void updateCache( const Driver::MemAccessMap &accessMap, unsigned short view );
+
+private:
+	Driver &                 driver_;
+	Driver::ViewMemAccessMap staged_;
+	Driver::ViewMemAccessMap prior_;
+	bool                     committed_{ false };
+	std::vector<Failure>     failures_;
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIPROTECTIONTRANSACTION_H_INCLUDED__
@@ -0,0 +1,52 @@
+// Copyright (c) 2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIREGISTERVIEW_H_INCLUDED__
+#define __BDVMIREGISTERVIEW_H_INCLUDED__
+
+#include "driver.h"
+
+namespace bdvmi {
+
+// Read-only access to the registers an event was delivered with. The accessors
+// read straight from the event, the full Registers object is only put together
+// (once) if registers() gets called. Only valid for the duration of the callback.
+class RegisterView {
+
+public:
+	virtual ~RegisterView() = default;
+
+public:
+	virtual uint64_t rip() const = 0;
+
+	virtual uint64_t rsp() const = 0;
+
+	virtual uint64_t rflags() const = 0;
+
+	virtual uint64_t cr0() const = 0;
+
+	virtual uint64_t cr3() const = 0;
+
+	virtual uint64_t cr4() const = 0;
+
+	virtual uint64_t msrEfer() const = 0;
+
+	// Everything, including guest_x86_mode
+	virtual const Registers &registers() const = 0;
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIREGISTERVIEW_H_INCLUDED__
@@ -0,0 +1,295 @@
+// Copyright (c) 2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMISTATICEVENTHANDLER_H_INCLUDED__
+#define __BDVMISTATICEVENTHANDLER_H_INCLUDED__
+
+#include "eventhandler.h"
+#include "registerview.h"
+#include <type_traits>
+
+namespace bdvmi {
+
+//
+// Compile-time alternative to implementing EventHandler directly:
+//
+//	class MyHandler : public StaticEventHandler<MyHandler> {
+//	public:
+//		void onCR( unsigned short vcpu, unsigned short crNumber, const RegisterView &regs,
+//		           uint64_t oldValue, uint64_t newValue, HVAction &action );
+//	};
+//
+// Define (non-virtual, not overloaded) only the on*() members you need. Every
+// EventHandler callback is a final override that calls the matching on*() directly,
+// so the compiler can inline it, and handledEvents() is worked out at compile time
+// from which on*() members Derived has, so the event manager doesn't call the rest
+// at all, runPreEvent() / runPostEvent() included.
+//
+template <typename Derived> class StaticEventHandler : public EventHandler {
+
+public:
+	void handleCRView( unsigned short vcpu, unsigned short crNumber, const RegisterView &regs, uint64_t oldValue,
+	                   uint64_t newValue, HVAction &action ) final
+	{
+		derived().onCR( vcpu, crNumber, regs, oldValue, newValue, action );
+	}
+
+	void handleMSR( unsigned short vcpu, uint32_t msr, uint64_t oldValue, uint64_t newValue,
+	                HVAction &action ) final
+	{
+		derived().onMSR( vcpu, msr, oldValue, newValue, action );
+	}
+
+	void handlePageFaultView( unsigned short vcpu, const RegisterView &regs, uint64_t physAddress,
+	                          uint64_t virtAddress, bool read, bool write, bool execute, bool inGpt,
+	                          HVAction &action, EmulatorContext &emulatorCtx,
+	                          unsigned short &instructionSize ) final
+	{
+		derived().onPageFault( vcpu, regs, physAddress, virtAddress, read, write, execute, inGpt, action,
+		                       emulatorCtx, instructionSize );
+	}
+
+	void handleVMCALLView( unsigned short vcpu, const RegisterView &regs ) final
+	{
+		derived().onVMCALL( vcpu, regs );
+	}
+
+	void handleXSETBV( unsigned short vcpu ) final
+	{
+		derived().onXSETBV( vcpu );
+	}
+
+	bool handleBreakpointView( unsigned short vcpu, const RegisterView &regs, uint64_t gpa ) final
+	{
+		return derived().onBreakpoint( vcpu, regs, gpa );
+	}
+
+	void handleInterruptView( unsigned short vcpu, const RegisterView &regs, uint32_t vector, uint64_t errorCode,
+	                          uint64_t cr2 ) final
+	{
+		derived().onInterrupt( vcpu, regs, vector, errorCode, cr2 );
+	}
+
+	void handleDescriptorAccessView( unsigned short vcpu, const RegisterView &regs, unsigned int flags,
+	                                 unsigned short &instructionLength, HVAction &action ) final
+	{
+		derived().onDescriptorAccess( vcpu, regs, flags, instructionLength, action );
+	}
+
+	void handleHotPage( unsigned short vcpu, uint64_t physAddress, unsigned short view,
+	                    uint64_t violationsPerSecond, bool &relax ) final
+	{
+		derived().onHotPage( vcpu, physAddress, view, violationsPerSecond, relax );
+	}
+
+	void handleSessionOver( GuestState state ) final
+	{
+		derived().onSessionOver( state );
+	}
+
+	void handleFatalError() final
+	{
+		derived().onFatalError();
+	}
+
+	void runPreEvent() final
+	{
+		derived().onPreEvent();
+	}
+
+	void runPostEvent() final
+	{
+		derived().onPostEvent();
+	}
+
+	unsigned int handledEvents() const final
+	{
+		using Base = StaticEventHandler<Derived>;
+
+		return has( &Derived::onCR, &Base::onCR, BDVMI_EVENT_CR ) |
+		        has( &Derived::onMSR, &Base::onMSR, BDVMI_EVENT_MSR ) |
+		        has( &Derived::onPageFault, &Base::onPageFault, BDVMI_EVENT_PAGE_FAULT ) |
+		        has( &Derived::onVMCALL, &Base::onVMCALL, BDVMI_EVENT_VMCALL ) |
+		        has( &Derived::onXSETBV, &Base::onXSETBV, BDVMI_EVENT_XSETBV ) |
+		        has( &Derived::onBreakpoint, &Base::onBreakpoint, BDVMI_EVENT_BREAKPOINT ) |
+		        has( &Derived::onInterrupt, &Base::onInterrupt, BDVMI_EVENT_INTERRUPT ) |
+		        has( &Derived::onDescriptorAccess, &Base::onDescriptorAccess, BDVMI_EVENT_DESCRIPTOR ) |
+		        has( &Derived::onHotPage, &Base::onHotPage, BDVMI_EVENT_HOT_PAGE ) |
+		        ( has( &Derived::onPreEvent, &Base::onPreEvent, BDVMI_EVENT_PRE_POST ) |
+		          has( &Derived::onPostEvent, &Base::onPostEvent, BDVMI_EVENT_PRE_POST ) );
+	}
+
+protected:
+	// The defaults, hidden by whatever Derived defines. They do what the event
+	// manager does for events nobody handles.
+	void onCR( unsigned short, unsigned short, const RegisterView &, uint64_t, uint64_t, HVAction & )
+	{
+	}
+
+	void onMSR( unsigned short, uint32_t, uint64_t, uint64_t, HVAction & )
+	{
+	}
+
+	void onPageFault( unsigned short, const RegisterView &, uint64_t, uint64_t, bool, bool, bool, bool, HVAction &,
+	                  EmulatorContext &, unsigned short & )
+	{
+	}
+
+	void onVMCALL( unsigned short, const RegisterView & )
+	{
+	}
+
+	void onXSETBV( unsigned short )
+	{
+	}
+
+	bool onBreakpoint( unsigned short, const RegisterView &, uint64_t )
+	{
+		return true; // don't reinject
+	}
+
+	void onInterrupt( unsigned short, const RegisterView &, uint32_t, uint64_t, uint64_t )
+	{
+	}
+
+	void onDescriptorAccess( unsigned short, const RegisterView &, unsigned int, unsigned short &, HVAction & )
+	{
+	}
+
+	void onHotPage( unsigned short, uint64_t, unsigned short, uint64_t, bool & )
+	{
+	}
+
+	void onSessionOver( GuestState )
+	{
+	}
+
+	void onFatalError()
+	{
+	}
+
+	void onPreEvent()
+	{
+	}
+
+	void onPostEvent()
+	{
+	}
+
+private:
+	// The library only calls the RegisterView variants, these are just here to complete
+	// the interface for code that calls an EventHandler directly.
+	class FullRegisterView : public RegisterView {
+
+	public:
+		explicit FullRegisterView( const Registers &regs ) : regs_{ regs }
+		{
+		}
+
+		uint64_t rip() const override
+		{
+			return regs_.rip;
+		}
+
+		uint64_t rsp() const override
+		{
+			return regs_.rsp;
+		}
+
+		uint64_t rflags() const override
+		{
+			return regs_.rflags;
+		}
+
+		uint64_t cr0() const override
+		{
+			return regs_.cr0;
+		}
+
+		uint64_t cr3() const override
+		{
+			return regs_.cr3;
+		}
+
+		uint64_t cr4() const override
+		{
+			return regs_.cr4;
+		}
+
+		uint64_t msrEfer() const override
+		{
+			return regs_.msr_efer;
+		}
+
+		const Registers &registers() const override
+		{
+			return regs_;
+		}
+
+	private:
+		const Registers &regs_;
+	};
+
+	void handleCR( unsigned short vcpu, unsigned short crNumber, const Registers &regs, uint64_t oldValue,
+	               uint64_t newValue, HVAction &action ) final
+	{
+		handleCRView( vcpu, crNumber, FullRegisterView( regs ), oldValue, newValue, action );
+	}
+
+	void handlePageFault( unsigned short vcpu, const Registers &regs, uint64_t physAddress, uint64_t virtAddress,
+	                      bool read, bool write, bool execute, bool inGpt, HVAction &action,
+	                      EmulatorContext &emulatorCtx, unsigned short &instructionSize ) final
+	{
+		handlePageFaultView( vcpu, FullRegisterView( regs ), physAddress, virtAddress, read, write, execute,
+		                     inGpt, action, emulatorCtx, instructionSize );
+	}
+
+	void handleVMCALL( unsigned short vcpu, const Registers &regs ) final
+	{
+		handleVMCALLView( vcpu, FullRegisterView( regs ) );
+	}
+
+	bool handleBreakpoint( unsigned short vcpu, const Registers &regs, uint64_t gpa ) final
+	{
+		return handleBreakpointView( vcpu, FullRegisterView( regs ), gpa );
+	}
+
+	void handleInterrupt( unsigned short vcpu, const Registers &regs, uint32_t vector, uint64_t errorCode,
+	                      uint64_t cr2 ) final
+	{
+		handleInterruptView( vcpu, FullRegisterView( regs ), vector, errorCode, cr2 );
+	}
+
+	void handleDescriptorAccess( unsigned short vcpu, const Registers &regs, unsigned int flags,
+	                             unsigned short &instructionLength, HVAction &action ) final
+	{
+		handleDescriptorAccessView( vcpu, FullRegisterView( regs ), flags, instructionLength, action );
+	}
+
+	Derived &derived()
+	{
+		return static_cast<Derived &>( *this );
+	}
+
+	// bit if Derived has its own version of a callback (its member pointer type isn't the default's)
+	template <typename D, typename B> static constexpr unsigned int has( D, B, unsigned int bit )
+	{
+		return std::is_same<D, B>::value ? 0 : bit;
+	}
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMISTATICEVENTHANDLER_H_INCLUDED__
@@ -15,9 +15,19 @@
 
 #include "bdvmi/driver.h"
 #include "bdvmi/logger.h"
+#include "memaccesstable.h"
+#include <algorithm>
 
 namespace bdvmi {
 
+Driver::Driver( EventHandler *handler )
+    : handler_{ handler }
+    , memAccessCache_{ new MemAccessTable }
+{
+}
+
+Driver::~Driver() = default;
+
 bool Driver::setPageProtection( unsigned long long guestAddress, bool read, bool write, bool execute,
                                 unsigned short view )
 {
@@ -40,10 +50,60 @@ bool Driver::setPageProtection( unsigned long long guestAddress, bool read, bool
 	uint64_t gfn       = gpa_to_gfn( guestAddress );
 	uint8_t  memaccess = ( read ? PAGE_READ : 0 ) | ( write ? PAGE_WRITE : 0 ) | ( execute ? PAGE_EXECUTE : 0 );
 
-	std::lock_guard<std::mutex> guard( memAccessCacheMutex_ );
-
-	memAccessCache_[view][gfn]        = memaccess;
+	// Both under the lock, so the cache can't end up disagreeing with what gets flushed
+	std::lock_guard<std::mutex> guard( delayedMemAccessMutex_ );
 	delayedMemAccessWrite_[view][gfn] = memaccess;
+	memAccessCache_->set( view, gfn, memaccess );
+
+	return true;
+}
+
+void Driver::registerPageClass( unsigned int classId, const std::vector<unsigned long long> &gfns )
+{
+	std::vector<uint64_t> sorted( gfns.begin(), gfns.end() );
+
+	std::sort( sorted.begin(), sorted.end() );
+	sorted.erase( std::unique( sorted.begin(), sorted.end() ), sorted.end() );
+
+	std::lock_guard<std::mutex> guard( pageClassMutex_ );
+	pageClasses_[classId].swap( sorted );
+}
+
+bool Driver::unregisterPageClass( unsigned int classId )
+{
+	std::lock_guard<std::mutex> guard( pageClassMutex_ );
+	return pageClasses_.erase( classId ) != 0;
+}
+
+bool Driver::setClassProtection( unsigned int classId, bool read, bool write, bool execute, unsigned short view )
+{
+	if ( write && !read ) {
+		logger << ERROR << "Attempted to set page class " << classId << " " << ( read ? "r" : "-" )
+		       << ( write ? "w" : "-" ) << ( execute ? "x" : "-" ) << std::flush;
+		return false;
+	}
+
+	uint8_t memaccess = ( read ? PAGE_READ : 0 ) | ( write ? PAGE_WRITE : 0 ) | ( execute ? PAGE_EXECUTE : 0 );
+
+	std::lock_guard<std::mutex> classGuard( pageClassMutex_ );
+
+	auto it = pageClasses_.find( classId );
+
+	if ( it == pageClasses_.end() ) {
+		logger << ERROR << "Unknown page class " << classId << std::flush;
+		return false;
+	}
+
+	std::lock_guard<std::mutex> guard( delayedMemAccessMutex_ );
+
+	auto &&accessMap = delayedMemAccessWrite_[view];
+
+	accessMap.reserve( accessMap.size() + it->second.size() );
+
+	for ( auto &&gfn : it->second ) {
+		accessMap[gfn] = memaccess;
+		memAccessCache_->set( view, gfn, memaccess );
+	}
 
 	return true;
 }
@@ -66,21 +126,12 @@ bool Driver::getPageProtection( unsigned long long guestAddress, bool &read, boo
 	uint64_t gfn       = gpa_to_gfn( guestAddress );
 	uint8_t  memaccess = 0;
 
-	{
-		std::lock_guard<std::mutex> guard( memAccessCacheMutex_ );
-
-		auto &&accessMap = memAccessCache_[view];
-		auto   it        = accessMap.find( gfn );
-
-		if ( it != accessMap.end() ) {
-			memaccess = it->second;
-
-			read    = !!( memaccess & PAGE_READ );
-			write   = !!( memaccess & PAGE_WRITE );
-			execute = !!( memaccess & PAGE_EXECUTE );
+	if ( memAccessCache_->get( view, gfn, memaccess ) ) {
+		read    = !!( memaccess & PAGE_READ );
+		write   = !!( memaccess & PAGE_WRITE );
+		execute = !!( memaccess & PAGE_EXECUTE );
 
-			return true;
-		}
+		return true;
 	}
 
 	if ( !getPageProtectionImpl( guestAddress, read, write, execute, view ) )
@@ -88,34 +139,49 @@ bool Driver::getPageProtection( unsigned long long guestAddress, bool &read, boo
 
 	memaccess = ( read ? PAGE_READ : 0 ) | ( write ? PAGE_WRITE : 0 ) | ( execute ? PAGE_EXECUTE : 0 );
 
-	std::lock_guard<std::mutex> guard( memAccessCacheMutex_ );
-	memAccessCache_[view][gfn] = memaccess;
+	// Don't clobber a setPageProtection() that raced with the query above
+	memAccessCache_->setIfUnknown( view, gfn, memaccess );
 
 	return true;
 }
 
 void Driver::flushPageProtections()
 {
+	// Flushers are serialized so that batches reach the hypervisor in the order they were staged,
+	// but setPageProtection() / getPageProtection() callers never wait on the hypercalls below.
+	std::lock_guard<std::mutex> flushGuard( flushMutex_ );
+
+	flushPageProtectionsLocked();
+}
+
+void Driver::flushPageProtectionsLocked()
+{
+	ViewMemAccessMap pendingMemAccess;
+
 	{
-		std::lock_guard<std::mutex> guard( memAccessCacheMutex_ );
+		std::lock_guard<std::mutex> guard( delayedMemAccessMutex_ );
+		pendingMemAccess.swap( delayedMemAccessWrite_ );
+	}
 
-		for ( auto &&item : delayedMemAccessWrite_ ) {
-			if ( item.second.empty() )
-				continue;
+	for ( auto &&item : pendingMemAccess ) {
+		if ( item.second.empty() )
+			continue;
 
-			setPageProtectionImpl( item.second, item.first );
-			item.second.clear();
-		}
+		setPageProtectionImpl( item.second, item.first );
 	}
 
-	std::lock_guard<std::mutex> guard( convertibleCacheMutex_ );
+	ViewConvertibleMap pendingConvertible;
+
+	{
+		std::lock_guard<std::mutex> guard( convertibleCacheMutex_ );
+		pendingConvertible.swap( delayedConvertibleWrite_ );
+	}
 
-	for ( auto &&item : delayedConvertibleWrite_ ) {
+	for ( auto &&item : pendingConvertible ) {
 		if ( item.second.empty() )
 			continue;
 
 		setPageConvertibleImpl( item.second, item.first );
-		item.second.clear();
 	}
 }
 
@@ -0,0 +1,109 @@
+// Copyright (c) 2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "bdvmi/eventhandler.h"
+#include "bdvmi/event.h"
+#include "bdvmi/registerview.h"
+
+namespace bdvmi {
+
+void EventHandler::handleCRView( unsigned short vcpu, unsigned short crNumber, const RegisterView &regs,
+                                 uint64_t oldValue, uint64_t newValue, HVAction &action )
+{
+	handleCR( vcpu, crNumber, regs.registers(), oldValue, newValue, action );
+}
+
+void EventHandler::handlePageFaultView( unsigned short vcpu, const RegisterView &regs, uint64_t physAddress,
+                                        uint64_t virtAddress, bool read, bool write, bool execute, bool inGpt,
+                                        HVAction &action, EmulatorContext &emulatorCtx,
+                                        unsigned short &instructionSize )
+{
+	handlePageFault( vcpu, regs.registers(), physAddress, virtAddress, read, write, execute, inGpt, action,
+	                 emulatorCtx, instructionSize );
+}
+
+void EventHandler::handleVMCALLView( unsigned short vcpu, const RegisterView &regs )
+{
+	handleVMCALL( vcpu, regs.registers() );
+}
+
+bool EventHandler::handleBreakpointView( unsigned short vcpu, const RegisterView &regs, uint64_t gpa )
+{
+	return handleBreakpoint( vcpu, regs.registers(), gpa );
+}
+
+void EventHandler::handleInterruptView( unsigned short vcpu, const RegisterView &regs, uint32_t vector,
+                                        uint64_t errorCode, uint64_t cr2 )
+{
+	handleInterrupt( vcpu, regs.registers(), vector, errorCode, cr2 );
+}
+
+void EventHandler::handleDescriptorAccessView( unsigned short vcpu, const RegisterView &regs, unsigned int flags,
+                                               unsigned short &instructionLength, HVAction &action )
+{
+	handleDescriptorAccess( vcpu, regs.registers(), flags, instructionLength, action );
+}
+
+void EventHandler::handleEvents( Event *events, size_t count )
+{
+	for ( size_t i = 0; i < count; ++i )
+		handleEvent( events[i] );
+}
+
+void EventHandler::handleEvent( Event &event )
+{
+	switch ( event.type ) {
+		case BDVMI_EVENT_CR:
+			handleCRView( event.vcpu, event.crNumber, *event.regs, event.oldValue, event.newValue,
+			              event.action );
+			break;
+
+		case BDVMI_EVENT_MSR:
+			handleMSR( event.vcpu, event.msr, event.oldValue, event.newValue, event.action );
+			break;
+
+		case BDVMI_EVENT_PAGE_FAULT:
+			handlePageFaultView( event.vcpu, *event.regs, event.physAddress, event.virtAddress, event.read,
+			                     event.write, event.execute, event.inGpt, event.action, event.emulatorCtx,
+			                     event.instructionSize );
+			break;
+
+		case BDVMI_EVENT_VMCALL:
+			handleVMCALLView( event.vcpu, *event.regs );
+			break;
+
+		case BDVMI_EVENT_XSETBV:
+			handleXSETBV( event.vcpu );
+			break;
+
+		case BDVMI_EVENT_BREAKPOINT:
+			event.reinject = !handleBreakpointView( event.vcpu, *event.regs, event.physAddress );
+			break;
+
+		case BDVMI_EVENT_INTERRUPT:
+			handleInterruptView( event.vcpu, *event.regs, event.vector, event.errorCode, event.cr2 );
+			break;
+
+		case BDVMI_EVENT_DESCRIPTOR:
+			handleDescriptorAccessView( event.vcpu, *event.regs, event.descriptorFlags,
+			                            event.instructionSize, event.action );
+			break;
+
+		default:
+			break;
+	}
+}
+
+} // namespace bdvmi
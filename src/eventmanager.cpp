@@ -14,9 +14,79 @@
 // License along with this library.
 
 #include "bdvmi/eventmanager.h"
+#include "bdvmi/event.h"
+#include "bdvmi/registerview.h"
+#include <algorithm>
 
 namespace bdvmi {
 
+namespace {
+
+bool filterMatches( const EventManager::EventFilter &filter, const Event &event )
+{
+	if ( !( filter.events & event.type ) )
+		return false;
+
+	if ( filter.vcpu >= 0 && filter.vcpu != event.vcpu )
+		return false;
+
+	if ( filter.index >= 0 ) {
+		int64_t index = -1;
+
+		switch ( event.type ) {
+			case BDVMI_EVENT_CR:
+				index = event.crNumber;
+				break;
+			case BDVMI_EVENT_MSR:
+				index = event.msr;
+				break;
+			case BDVMI_EVENT_INTERRUPT:
+				index = event.vector;
+				break;
+		}
+
+		if ( index != filter.index )
+			return false;
+	}
+
+	if ( event.type == BDVMI_EVENT_PAGE_FAULT || event.type == BDVMI_EVENT_BREAKPOINT ) {
+		unsigned long long gfn = gpa_to_gfn( event.physAddress );
+
+		if ( gfn < filter.gfnFirst || gfn > filter.gfnLast )
+			return false;
+	}
+
+	if ( filter.ripFirst != 0 || filter.ripLast != ~0ULL ) {
+		if ( !event.regs )
+			return false;
+
+		uint64_t rip = event.regs->rip(); // straight from the event, no Registers needed
+
+		if ( rip < filter.ripFirst || rip > filter.ripLast )
+			return false;
+	}
+
+	if ( event.type == BDVMI_EVENT_CR || event.type == BDVMI_EVENT_MSR ) {
+		if ( ( event.newValue & filter.valueMask ) != filter.valueMatch )
+			return false;
+
+		if ( ( event.oldValue ^ event.newValue ) & filter.watchedBits )
+			return false;
+	}
+
+	if ( event.type == BDVMI_EVENT_PAGE_FAULT && filter.access ) {
+		unsigned int access = ( event.read ? Driver::PAGE_READ : 0 ) | ( event.write ? Driver::PAGE_WRITE : 0 ) |
+		        ( event.execute ? Driver::PAGE_EXECUTE : 0 );
+
+		if ( access & ~filter.access )
+			return false;
+	}
+
+	return true;
+}
+
+} // end of anonymous namespace
+
 EventManager::EventManager( sig_atomic_t &sigStop )
 	: sigStop_{ sigStop }
 {
@@ -65,6 +135,27 @@ bool EventManager::enableCrEvents( unsigned int cr )
 	return true;
 }
 
+bool EventManager::enableCrEvents( unsigned int cr, uint64_t watchedBits, bool sync, bool onChangeOnly )
+{
+	if ( !watchedBits ) // Watching no bits at all would be pointless, take it as every bit
+		watchedBits = ~0ULL;
+
+	// The new settings don't simply replace the old ones (Xen refuses to enable them twice)
+	if ( enabledCrs_.find( cr ) != enabledCrs_.end() ) {
+		if ( !disableCrEventsImpl( cr ) )
+			return false;
+
+		enabledCrs_.erase( cr );
+	}
+
+	if ( !enableCrEventsImpl( cr, watchedBits, sync, onChangeOnly ) )
+		return false;
+
+	enabledCrs_.insert( cr );
+
+	return true;
+}
+
 bool EventManager::disableCrEvents( unsigned int cr )
 {
 	if ( enabledCrs_.find( cr ) == enabledCrs_.end() )
@@ -158,4 +249,242 @@ bool EventManager::disableDescriptorEvents()
 	return !descriptorEnabled_;
 }
 
+unsigned int EventManager::addEventFilter( const EventFilter &filter )
+{
+	if ( !filter.events )
+		return 0;
+
+	std::lock_guard<std::mutex> guard( filtersMutex_ );
+
+	std::shared_ptr<const FilterList> current = std::atomic_load( &filters_ );
+	std::shared_ptr<FilterList>       updated = current ? std::make_shared<FilterList>( *current )
+	                                                    : std::make_shared<FilterList>();
+	FilterEntry entry;
+
+	entry.id     = ++lastFilterId_;
+	entry.filter = filter;
+	entry.hits   = std::make_shared<std::atomic<uint64_t>>( 0 );
+
+	updated->push_back( entry );
+	publishFilters( updated );
+
+	return entry.id;
+}
+
+bool EventManager::removeEventFilter( unsigned int id )
+{
+	std::lock_guard<std::mutex> guard( filtersMutex_ );
+
+	std::shared_ptr<const FilterList> current = std::atomic_load( &filters_ );
+
+	if ( !current )
+		return false;
+
+	std::shared_ptr<FilterList> updated = std::make_shared<FilterList>( *current );
+
+	auto it = std::find_if( updated->begin(), updated->end(),
+	                        [id]( const FilterEntry &entry ) { return entry.id == id; } );
+
+	if ( it == updated->end() )
+		return false;
+
+	updated->erase( it );
+	publishFilters( updated );
+
+	return true;
+}
+
+void EventManager::clearEventFilters()
+{
+	std::lock_guard<std::mutex> guard( filtersMutex_ );
+
+	publishFilters( nullptr );
+}
+
+bool EventManager::eventFilterHits( unsigned int id, uint64_t &hits ) const
+{
+	std::shared_ptr<const FilterList> current = std::atomic_load( &filters_ );
+
+	if ( !current )
+		return false;
+
+	for ( auto &&entry : *current )
+		if ( entry.id == id ) {
+			hits = entry.hits->load( std::memory_order_relaxed );
+			return true;
+		}
+
+	return false;
+}
+
+void EventManager::publishFilters( std::shared_ptr<const FilterList> filters )
+{
+	unsigned int events = 0;
+
+	if ( filters )
+		for ( auto &&entry : *filters )
+			events |= entry.filter.events;
+
+	if ( filters && filters->empty() )
+		filters = nullptr;
+
+	std::atomic_store( &filters_, filters );
+	filteredEvents_ = events;
+}
+
+bool EventManager::filterEvent( Event &event )
+{
+	// Cheap way out for the (usual) case of no filters for this kind of event
+	if ( !( filteredEvents_.load( std::memory_order_relaxed ) & event.type ) )
+		return false;
+
+	std::shared_ptr<const FilterList> filters = std::atomic_load( &filters_ );
+
+	if ( !filters )
+		return false;
+
+	for ( auto &&entry : *filters )
+		if ( filterMatches( entry.filter, event ) ) {
+			entry.hits->fetch_add( 1, std::memory_order_relaxed );
+			event.action = entry.filter.action;
+			return true;
+		}
+
+	return false;
+}
+
+void EventManager::setHotPageThreshold( uint64_t violationsPerSecond, bool autoRelax )
+{
+	std::lock_guard<std::mutex> guard( hotPagesMutex_ );
+
+	hotPageAutoRelax_ = autoRelax;
+	hotPageThreshold_ = violationsPerSecond;
+
+	if ( !violationsPerSecond )
+		hotPages_.clear();
+}
+
+static inline uint64_t hotPageKey( unsigned short view, uint64_t gfn )
+{
+	return ( static_cast<uint64_t>( view ) << 48 ) | ( gfn & ( ( 1ULL << 48 ) - 1 ) );
+}
+
+bool EventManager::trackHotPage( unsigned short view, uint64_t gfn, uint64_t &rate )
+{
+	uint64_t threshold = hotPageThreshold_.load( std::memory_order_relaxed );
+
+	if ( !threshold )
+		return false;
+
+	Clock::time_point now = Clock::now();
+
+	std::lock_guard<std::mutex> guard( hotPagesMutex_ );
+
+	uint64_t key = hotPageKey( view, gfn );
+
+	if ( hotPages_.size() >= MAX_HOT_PAGE_ENTRIES && hotPages_.find( key ) == hotPages_.end() )
+		pruneHotPages( now );
+
+	auto inserted = hotPages_.emplace( key, HotPageEntry{} );
+	auto &entry   = inserted.first->second;
+
+	if ( inserted.second )
+		entry.windowStart = now;
+	else if ( now - entry.windowStart >= std::chrono::seconds( 1 ) ) {
+		// A window that ended more than a second ago says nothing about the current rate
+		entry.lastRate    = ( now - entry.windowStart < std::chrono::seconds( 2 ) ) ? entry.windowCount : 0;
+		entry.windowStart = now;
+		entry.windowCount = 0;
+		entry.reported    = false;
+	}
+
+	++entry.windowCount;
+	++entry.total;
+
+	if ( entry.reported || entry.windowCount < threshold )
+		return false;
+
+	entry.reported = true;
+	rate           = entry.windowCount;
+
+	return true;
+}
+
+void EventManager::markHotPageRelaxed( unsigned short view, uint64_t gfn )
+{
+	std::lock_guard<std::mutex> guard( hotPagesMutex_ );
+
+	auto it = hotPages_.find( hotPageKey( view, gfn ) );
+
+	if ( it != hotPages_.end() )
+		it->second.relaxed = true;
+}
+
+void EventManager::pruneHotPages( Clock::time_point now )
+{
+	// Forget pages that have been quiet for a couple of windows
+	for ( auto it = hotPages_.begin(); it != hotPages_.end(); ) {
+		if ( now - it->second.windowStart >= std::chrono::seconds( 2 ) )
+			it = hotPages_.erase( it );
+		else
+			++it;
+	}
+
+	if ( hotPages_.size() < MAX_HOT_PAGE_ENTRIES )
+		return;
+
+	// More pages than that are faulting right now, make room by dropping the coldest quarter
+	std::vector<std::pair<uint64_t, uint64_t>> heat; // ( rate, key )
+
+	heat.reserve( hotPages_.size() );
+
+	for ( auto &&item : hotPages_ )
+		heat.emplace_back( std::max( item.second.windowCount, item.second.lastRate ), item.first );
+
+	auto cut = heat.begin() + heat.size() / 4;
+
+	std::nth_element( heat.begin(), cut, heat.end() );
+
+	for ( auto it = heat.begin(); it != cut; ++it )
+		hotPages_.erase( it->second );
+}
+
+std::vector<EventManager::HotPageInfo> EventManager::hotPages( size_t count ) const
+{
+	std::vector<HotPageInfo> pages;
+	Clock::time_point        now = Clock::now();
+
+	{
+		std::lock_guard<std::mutex> guard( hotPagesMutex_ );
+
+		pages.reserve( hotPages_.size() );
+
+		for ( auto &&item : hotPages_ ) {
+			const HotPageEntry &entry = item.second;
+			HotPageInfo         info;
+
+			info.view    = static_cast<unsigned short>( item.first >> 48 );
+			info.gfn     = item.first & ( ( 1ULL << 48 ) - 1 );
+			info.total   = entry.total;
+			info.relaxed = entry.relaxed;
+
+			if ( now - entry.windowStart < std::chrono::seconds( 1 ) )
+				info.rate = std::max( entry.lastRate, entry.windowCount );
+			else if ( now - entry.windowStart < std::chrono::seconds( 2 ) )
+				info.rate = entry.windowCount;
+
+			pages.push_back( info );
+		}
+	}
+
+	count = std::min( count, pages.size() );
+
+	std::partial_sort( pages.begin(), pages.begin() + count, pages.end(),
+	                   []( const HotPageInfo &a, const HotPageInfo &b ) { return a.rate > b.rate; } );
+
+	pages.resize( count );
+
+	return pages;
+}
+
 } // namespace bdvmi
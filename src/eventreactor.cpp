@@ -0,0 +1,301 @@
+// Copyright (c) 2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "bdvmi/eventreactor.h"
+#include "bdvmi/eventmanager.h"
+#include "bdvmi/logger.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+namespace bdvmi {
+
+namespace {
+
+constexpr uint64_t WAKE_ID           = 0; // entry ids start at 1
+constexpr int      SWEEP_INTERVAL_MS = 100;
+
+} // end of anonymous namespace
+
+struct EventReactor::Entry {
+	uint64_t         id{ 0 };
+	EventManager *   em{ nullptr };
+	std::vector<int> fds;
+	std::mutex       mutex;
+	bool             detached{ false };
+};
+
+EventReactor::EventReactor( unsigned int threads ) : threads_{ threads ? threads : 1 }
+{
+	epollFd_ = epoll_create1( EPOLL_CLOEXEC );
+
+	if ( epollFd_ < 0 )
+		throw std::runtime_error( std::string( "[EventReactor] epoll_create1() failed: " ) + strerror( errno ) );
+
+	wakeFd_ = eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK );
+
+	if ( wakeFd_ < 0 ) {
+		close( epollFd_ );
+		throw std::runtime_error( std::string( "[EventReactor] eventfd() failed: " ) + strerror( errno ) );
+	}
+
+	// Level-triggered and never read, so once stop() writes to it every thread wakes up
+	epoll_event ev{};
+
+	ev.events   = EPOLLIN;
+	ev.data.u64 = WAKE_ID;
+
+	if ( epoll_ctl( epollFd_, EPOLL_CTL_ADD, wakeFd_, &ev ) < 0 ) {
+		close( wakeFd_ );
+		close( epollFd_ );
+		throw std::runtime_error( std::string( "[EventReactor] epoll_ctl() failed: " ) + strerror( errno ) );
+	}
+}
+
+EventReactor::~EventReactor()
+{
+	close( wakeFd_ );
+	close( epollFd_ );
+}
+
+bool EventReactor::add( EventManager *em )
+{
+	if ( !em )
+		return false;
+
+	std::shared_ptr<Entry> entry = std::make_shared<Entry>();
+
+	entry->em  = em;
+	entry->fds = em->descriptors();
+
+	if ( entry->fds.empty() ) {
+		logger << ERROR << "[EventReactor] the event manager can't be multiplexed" << std::flush;
+		return false;
+	}
+
+	std::lock_guard<std::mutex> entryLock( entry->mutex );
+
+	{
+		std::lock_guard<std::mutex> lock( entriesMutex_ );
+
+		for ( auto &&item : entries_ )
+			if ( item.second->em == em )
+				return false;
+
+		entry->id = ++lastId_;
+		entries_[entry->id] = entry;
+	}
+
+	if ( !arm( *entry, EPOLL_CTL_ADD ) ) {
+		detach( *entry );
+		return false;
+	}
+
+	return true;
+}
+
+bool EventReactor::remove( EventManager *em )
+{
+	std::shared_ptr<Entry> entry;
+
+	{
+		std::lock_guard<std::mutex> lock( entriesMutex_ );
+
+		for ( auto &&item : entries_ )
+			if ( item.second->em == em ) {
+				entry = item.second;
+				break;
+			}
+	}
+
+	if ( !entry )
+		return false;
+
+	std::lock_guard<std::mutex> lock( entry->mutex );
+
+	if ( entry->detached )
+		return false;
+
+	detach( *entry );
+
+	return true;
+}
+
+size_t EventReactor::size() const
+{
+	std::lock_guard<std::mutex> lock( entriesMutex_ );
+
+	return entries_.size();
+}
+
+void EventReactor::run()
+{
+	std::vector<std::thread> pool;
+
+	stop_ = false;
+
+	for ( unsigned int i = 1; i < threads_; ++i )
+		pool.emplace_back( [this]() { serve( false ); } );
+
+	serve( true );
+
+	for ( auto &&thread : pool )
+		thread.join();
+
+	// Ready for another run()
+	uint64_t value = 0;
+	if ( read( wakeFd_, &value, sizeof( value ) ) < 0 && errno != EAGAIN )
+		logger << WARNING << "[EventReactor] could not reset the wakeup eventfd" << std::flush;
+}
+
+void EventReactor::stop()
+{
+	stop_ = true;
+
+	uint64_t value = 1;
+	if ( write( wakeFd_, &value, sizeof( value ) ) < 0 )
+		logger << ERROR << "[EventReactor] could not wake up the threads: " << strerror( errno ) << std::flush;
+}
+
+void EventReactor::serve( bool sweeper )
+{
+	auto lastSweep = std::chrono::steady_clock::now();
+
+	while ( !stop_ ) {
+		epoll_event ev{};
+
+		int rc = epoll_wait( epollFd_, &ev, 1, SWEEP_INTERVAL_MS );
+
+		if ( rc < 0 && errno != EINTR ) {
+			logger << ERROR << "[EventReactor] epoll_wait() failed: " << strerror( errno ) << std::flush;
+			stop();
+			break;
+		}
+
+		if ( rc == 1 && ev.data.u64 != WAKE_ID ) {
+			std::shared_ptr<Entry> entry = find( ev.data.u64 );
+
+			if ( entry )
+				service( entry, true );
+		}
+
+		if ( sweeper && std::chrono::steady_clock::now() - lastSweep >=
+		                        std::chrono::milliseconds( SWEEP_INTERVAL_MS ) ) {
+			sweep();
+			lastSweep = std::chrono::steady_clock::now();
+		}
+	}
+}
+
+std::shared_ptr<EventReactor::Entry> EventReactor::find( uint64_t id ) const
+{
+	std::lock_guard<std::mutex> lock( entriesMutex_ );
+
+	auto i = entries_.find( id );
+
+	if ( i == entries_.end() )
+		return nullptr;
+
+	return i->second;
+}
+
+void EventReactor::service( const std::shared_ptr<Entry> &entry, bool wait )
+{
+	std::unique_lock<std::mutex> lock( entry->mutex, std::defer_lock );
+
+	if ( wait )
+		lock.lock();
+	else if ( !lock.try_lock() )
+		return;
+
+	if ( entry->detached )
+		return;
+
+	bool running = false;
+
+	try {
+		running = entry->em->processEvents();
+	} catch ( const std::exception &e ) {
+		logger << ERROR << "[EventReactor] " << e.what() << ", dropping the event manager" << std::flush;
+	}
+
+	if ( running ) {
+		// EPOLLONESHOT disabled whichever descriptor fired, nobody else can be on this entry until now
+		if ( arm( *entry, EPOLL_CTL_MOD ) )
+			return;
+
+		logger << ERROR << "[EventReactor] could not re-arm, dropping the event manager" << std::flush;
+	}
+
+	detach( *entry );
+	lock.unlock();
+
+	if ( onStopped_ )
+		onStopped_( entry->em );
+}
+
+void EventReactor::sweep()
+{
+	std::vector<std::shared_ptr<Entry>> snapshot;
+
+	{
+		std::lock_guard<std::mutex> lock( entriesMutex_ );
+
+		snapshot.reserve( entries_.size() );
+
+		for ( auto &&item : entries_ )
+			snapshot.push_back( item.second );
+	}
+
+	for ( auto &&entry : snapshot )
+		service( entry, false );
+}
+
+void EventReactor::detach( Entry &entry )
+{
+	for ( auto &&fd : entry.fds )
+		epoll_ctl( epollFd_, EPOLL_CTL_DEL, fd, nullptr );
+
+	entry.detached = true;
+
+	std::lock_guard<std::mutex> lock( entriesMutex_ );
+
+	entries_.erase( entry.id );
+}
+
+bool EventReactor::arm( const Entry &entry, int op )
+{
+	for ( auto &&fd : entry.fds ) {
+		epoll_event ev{};
+
+		ev.events   = EPOLLIN | EPOLLONESHOT;
+		ev.data.u64 = entry.id;
+
+		if ( epoll_ctl( epollFd_, op, fd, &ev ) < 0 ) {
+			logger << ERROR << "[EventReactor] epoll_ctl() failed for fd " << fd << ": " << strerror( errno )
+			       << std::flush;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+} // namespace bdvmi
@@ -0,0 +1,159 @@
+// Copyright (c) 2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "memaccesstable.h"
+
+namespace bdvmi {
+
+namespace {
+
+template <typename T> T *installNode( std::atomic<T *> &slot )
+{
+	T *node = slot.load( std::memory_order_acquire );
+
+	if ( node )
+		return node;
+
+	T *fresh = new T{};
+
+	if ( slot.compare_exchange_strong( node, fresh, std::memory_order_acq_rel, std::memory_order_acquire ) )
+		return fresh;
+
+	// Somebody else beat us to it, node now holds the winner
+	delete fresh;
+	return node;
+}
+
+} // end of anonymous namespace
+
+MemAccessTable::~MemAccessTable()
+{
+	for ( auto &&root : roots_ )
+		destroy( root.load( std::memory_order_relaxed ), 0 );
+}
+
+void MemAccessTable::destroy( Dir *dir, unsigned int level )
+{
+	if ( !dir )
+		return;
+
+	for ( auto &&slot : dir->slots ) {
+		void *child = slot.load( std::memory_order_relaxed );
+
+		if ( !child )
+			continue;
+
+		if ( level + 1 < DIR_LEVELS )
+			destroy( static_cast<Dir *>( child ), level + 1 );
+		else
+			delete static_cast<Leaf *>( child );
+	}
+
+	delete dir;
+}
+
+const std::atomic<uint8_t> *MemAccessTable::find( unsigned short view, uint64_t gfn ) const
+{
+	if ( view >= MAX_VIEWS || ( gfn >> GFN_BITS ) )
+		return nullptr;
+
+	void *node = roots_[view].load( std::memory_order_acquire );
+
+	for ( unsigned int level = 0; level < DIR_LEVELS && node; ++level ) {
+		unsigned int shift = LEAF_BITS + DIR_BITS * ( DIR_LEVELS - 1 - level );
+		unsigned int index = ( gfn >> shift ) & ( ( 1u << DIR_BITS ) - 1 );
+
+		node = static_cast<Dir *>( node )->slots[index].load( std::memory_order_acquire );
+	}
+
+	if ( !node )
+		return nullptr;
+
+	return &static_cast<Leaf *>( node )->entries[gfn & ( ( 1u << LEAF_BITS ) - 1 )];
+}
+
+std::atomic<uint8_t> *MemAccessTable::findOrCreate( unsigned short view, uint64_t gfn )
+{
+	if ( view >= MAX_VIEWS || ( gfn >> GFN_BITS ) )
+		return nullptr;
+
+	Dir *dir = installNode( roots_[view] );
+
+	for ( unsigned int level = 0; level < DIR_LEVELS; ++level ) {
+		unsigned int shift = LEAF_BITS + DIR_BITS * ( DIR_LEVELS - 1 - level );
+		unsigned int index = ( gfn >> shift ) & ( ( 1u << DIR_BITS ) - 1 );
+
+		auto &slot = dir->slots[index];
+		void *node = slot.load( std::memory_order_acquire );
+
+		if ( !node ) {
+			void *fresh = ( level + 1 < DIR_LEVELS ) ? static_cast<void *>( new Dir{} )
+			                                         : static_cast<void *>( new Leaf{} );
+
+			if ( slot.compare_exchange_strong( node, fresh, std::memory_order_acq_rel,
+			                                   std::memory_order_acquire ) )
+				node = fresh;
+			else if ( level + 1 < DIR_LEVELS )
+				delete static_cast<Dir *>( fresh );
+			else
+				delete static_cast<Leaf *>( fresh );
+		}
+
+		if ( level + 1 == DIR_LEVELS )
+			return &static_cast<Leaf *>( node )->entries[gfn & ( ( 1u << LEAF_BITS ) - 1 )];
+
+		dir = static_cast<Dir *>( node );
+	}
+
+	return nullptr; // not reached
+}
+
+bool MemAccessTable::get( unsigned short view, uint64_t gfn, uint8_t &access ) const
+{
+	const std::atomic<uint8_t> *entry = find( view, gfn );
+
+	if ( !entry )
+		return false;
+
+	uint8_t value = entry->load( std::memory_order_acquire );
+
+	if ( !( value & VALID ) )
+		return false;
+
+	access = value & ~VALID;
+	return true;
+}
+
+void MemAccessTable::set( unsigned short view, uint64_t gfn, uint8_t access )
+{
+	std::atomic<uint8_t> *entry = findOrCreate( view, gfn );
+
+	if ( entry )
+		entry->store( access | VALID, std::memory_order_release );
+}
+
+void MemAccessTable::setIfUnknown( unsigned short view, uint64_t gfn, uint8_t access )
+{
+	std::atomic<uint8_t> *entry = findOrCreate( view, gfn );
+
+	if ( !entry )
+		return;
+
+	uint8_t expected = 0;
+	entry->compare_exchange_strong( expected, access | VALID, std::memory_order_acq_rel,
+	                                std::memory_order_acquire );
+}
+
+} // namespace bdvmi
@@ -0,0 +1,85 @@
+// Copyright (c) 2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIMEMACCESSTABLE_H_INCLUDED__
+#define __BDVMIMEMACCESSTABLE_H_INCLUDED__
+
+#include <atomic>
+#include <cstddef>
+#include <stdint.h>
+
+namespace bdvmi {
+
+//
+// Per-view page protection cache, readable without taking any locks.
+//
+// Every view is a small radix tree over the gfn, with atomic slots and atomic
+// one-byte leaves. Nodes are only ever added (with a CAS), never removed while
+// the table is alive, so lookups are just a chain of acquire loads and can run
+// concurrently with writers on any thread. An entry of 0 means "not cached".
+//
+class MemAccessTable {
+
+public:
+	// The EPTP list can't hold more than 512 entries, so no view index can be larger.
+	static constexpr unsigned int MAX_VIEWS = 512;
+
+private:
+	static constexpr unsigned int LEAF_BITS  = 12;
+	static constexpr unsigned int DIR_BITS   = 10;
+	static constexpr unsigned int DIR_LEVELS = 3;
+	static constexpr unsigned int GFN_BITS   = LEAF_BITS + DIR_BITS * DIR_LEVELS;
+	static constexpr uint8_t      VALID      = 0x80;
+
+	struct Leaf {
+		std::atomic<uint8_t> entries[1u << LEAF_BITS];
+	};
+
+	struct Dir {
+		std::atomic<void *> slots[1u << DIR_BITS];
+	};
+
+public:
+	MemAccessTable() = default;
+	~MemAccessTable();
+
+public:
+	// Lock-free lookup, false if the (view, gfn) rights are not cached
+	bool get( unsigned short view, uint64_t gfn, uint8_t &access ) const;
+
+	// Lock-free update
+	void set( unsigned short view, uint64_t gfn, uint8_t access );
+
+	// Only caches access if nobody else has cached something for gfn meanwhile
+	void setIfUnknown( unsigned short view, uint64_t gfn, uint8_t access );
+
+public:
+	MemAccessTable( const MemAccessTable & ) = delete;
+	MemAccessTable &operator=( const MemAccessTable & ) = delete;
+
+private:
+	const std::atomic<uint8_t> *find( unsigned short view, uint64_t gfn ) const;
+
+	std::atomic<uint8_t> *findOrCreate( unsigned short view, uint64_t gfn );
+
+	static void destroy( Dir *dir, unsigned int level );
+
+private:
+	std::atomic<Dir *> roots_[MAX_VIEWS]{};
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIMEMACCESSTABLE_H_INCLUDED__
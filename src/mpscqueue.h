@@ -0,0 +1,106 @@
+// Copyright (c) 2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMIMPSCQUEUE_H_INCLUDED__
+#define __BDVMIMPSCQUEUE_H_INCLUDED__
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+namespace bdvmi {
+
+// Unbounded lock-free queue for any number of producer threads and a single consumer.
+// Producers push onto a list head, the consumer takes the whole list at once.
+template <typename T> class MPSCQueue {
+
+	struct Node {
+		T     item;
+		Node *next;
+	};
+
+public:
+	MPSCQueue() = default;
+
+	~MPSCQueue()
+	{
+		destroy( head_.load( std::memory_order_acquire ) );
+	}
+
+public:
+	void push( T item )
+	{
+		Node *node = new Node{ std::move( item ), head_.load( std::memory_order_relaxed ) };
+
+		while ( !head_.compare_exchange_weak( node->next, node, std::memory_order_release,
+		                                      std::memory_order_relaxed ) )
+			;
+	}
+
+	// Consumer side: hands everything pushed so far to fn (which must not throw), oldest first.
+	// Returns how many items there were.
+	template <typename Fn> size_t drain( Fn fn )
+	{
+		Node *list = head_.exchange( nullptr, std::memory_order_acquire );
+		Node *fifo = nullptr;
+
+		while ( list ) {
+			Node *next = list->next;
+			list->next = fifo;
+			fifo       = list;
+			list       = next;
+		}
+
+		size_t count = 0;
+
+		while ( fifo ) {
+			Node *next = fifo->next;
+
+			fn( fifo->item );
+
+			delete fifo;
+			fifo = next;
+			++count;
+		}
+
+		return count;
+	}
+
+	bool empty() const
+	{
+		return head_.load( std::memory_order_acquire ) == nullptr;
+	}
+
+public:
+	MPSCQueue( const MPSCQueue & ) = delete;
+	MPSCQueue &operator=( const MPSCQueue & ) = delete;
+
+private:
+	static void destroy( Node *node )
+	{
+		while ( node ) {
+			Node *next = node->next;
+			delete node;
+			node = next;
+		}
+	}
+
+private:
+	std::atomic<Node *> head_{ nullptr };
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMIMPSCQUEUE_H_INCLUDED__
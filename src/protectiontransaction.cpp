@@ -0,0 +1,226 @@
+// Copyright (c) 2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#include "bdvmi/protectiontransaction.h"
+#include "bdvmi/logger.h"
+#include "memaccesstable.h"
+#include <algorithm>
+#include <cerrno>
+#include <utility>
+
+namespace bdvmi {
+
+ProtectionTransaction::ProtectionTransaction( Driver &driver ) : driver_{ driver }
+{
+}
+
+bool ProtectionTransaction::setPageProtection( unsigned long long guestAddress, bool read, bool write, bool execute,
+                                               unsigned short view )
+{
+	// Same rule as Driver::setPageProtection(): write-only EPT entries are a misconfiguration
+	if ( write && !read ) {
+		logger << ERROR << "Attempted to stage GPA " << std::hex << std::showbase << guestAddress << " "
+		       << ( read ? "r" : "-" ) << ( write ? "w" : "-" ) << ( execute ? "x" : "-" ) << std::flush;
+		return false;
+	}
+
+	if ( committed_ ) {
+		logger << ERROR << "ProtectionTransaction: cannot stage changes after commit()" << std::flush;
+		return false;
+	}
+
+	uint8_t memaccess = ( read ? Driver::PAGE_READ : 0 ) | ( write ? Driver::PAGE_WRITE : 0 ) |
+	        ( execute ? Driver::PAGE_EXECUTE : 0 );
+
+	staged_[view][gpa_to_gfn( guestAddress )] = memaccess;
+
+	return true;
+}
+
+size_t ProtectionTransaction::size() const
+{
+	size_t count = 0;
+
+	for ( auto &&item : staged_ )
+		count += item.second.size();
+
+	return count;
+}
+
+void ProtectionTransaction::clear()
+{
+	staged_.clear();
+	prior_.clear();
+	failures_.clear();
+	committed_ = false;
+}
+
+bool ProtectionTransaction::commit()
+{
+	if ( committed_ )
+		return true;
+
+	failures_.clear();
+	prior_.clear();
+
+	// No other flush may get in between recording the prior rights and applying ours
+	std::lock_guard<std::mutex> guard( driver_.flushMutex_ );
+
+	// Whatever was queued with Driver::setPageProtection() must land first, both to keep
+	// ordering and so that the rights we record below are the ones actually in effect.
+	driver_.flushPageProtectionsLocked();
+
+	for ( auto &&viewItem : staged_ ) {
+		auto &priorMap = prior_[viewItem.first];
+
+		for ( auto &&item : viewItem.second ) {
+			bool read, write, execute;
+
+			if ( !driver_.getPageProtection( gfn_to_gpa( item.first ), read, write, execute,
+			                                 viewItem.first ) ) {
+				Failure failure;
+
+				failure.view  = viewItem.first;
+				failure.gfn   = item.first;
+				failure.count = 1;
+				failure.error = errno;
+
+				failures_.push_back( failure );
+				continue;
+			}
+
+			priorMap[item.first] = ( read ? Driver::PAGE_READ : 0 ) | ( write ? Driver::PAGE_WRITE : 0 ) |
+			        ( execute ? Driver::PAGE_EXECUTE : 0 );
+		}
+	}
+
+	// Without the prior rights we could not undo a partial failure, so don't start at all
+	if ( !failures_.empty() ) {
+		logger << ERROR << "ProtectionTransaction: could not record prior rights for " << std::dec
+		       << failures_.size() << " page(s), nothing committed" << std::flush;
+		prior_.clear();
+		return false;
+	}
+
+	Driver::ViewMemAccessMap applied;
+
+	if ( apply( staged_, applied, failures_ ) ) {
+		committed_ = true;
+		return true;
+	}
+
+	// A refused call may still have changed some of its pages before failing, so not only what's in
+	// applied may be off: put back the prior rights of everything staged (prior_ has it all).
+	Driver::ViewMemAccessMap restored;
+	std::vector<Failure>     restoreFailures;
+
+	if ( !apply( prior_, restored, restoreFailures ) )
+		logger << ERROR << "ProtectionTransaction: failed to restore " << std::dec << restoreFailures.size()
+		       << " range(s) after a partial commit" << std::flush;
+
+	prior_.clear();
+	return false;
+}
+
+bool ProtectionTransaction::rollback()
+{
+	if ( !committed_ )
+		return false;
+
+	failures_.clear();
+
+	std::lock_guard<std::mutex> guard( driver_.flushMutex_ );
+
+	Driver::ViewMemAccessMap restored;
+
+	if ( !apply( prior_, restored, failures_ ) )
+		return false;
+
+	committed_ = false;
+	return true;
+}
+
+bool ProtectionTransaction::apply( const Driver::ViewMemAccessMap &changes, Driver::ViewMemAccessMap &applied,
+                                   std::vector<Failure> &failures )
+{
+	bool ret = true;
+
+	for ( auto &&viewItem : changes ) {
+		if ( viewItem.second.empty() )
+			continue;
+
+		// Optimistic path: the whole view in one go
+		if ( driver_.setPageProtectionImpl( viewItem.second, viewItem.first ) ) {
+			updateCache( viewItem.second, viewItem.first );
+			applied[viewItem.first] = viewItem.second;
+			continue;
+		}
+
+		if ( !applyRuns( viewItem.second, viewItem.first, applied[viewItem.first], failures ) )
+			ret = false;
+	}
+
+	return ret;
+}
+
+bool ProtectionTransaction::applyRuns( const Driver::MemAccessMap &changes, unsigned short view,
+                                       Driver::MemAccessMap &applied, std::vector<Failure> &failures )
+{
+	// The batch was refused: retry it as contiguous same-rights runs to find out which ranges are at fault
+	std::vector<std::pair<uint64_t, uint8_t>> sorted( changes.begin(), changes.end() );
+	std::sort( sorted.begin(), sorted.end() );
+
+	bool ret = true;
+
+	for ( size_t first = 0; first < sorted.size(); ) {
+		size_t last = first + 1;
+
+		while ( last < sorted.size() && sorted[last].first == sorted[last - 1].first + 1 &&
+		        sorted[last].second == sorted[first].second )
+			++last;
+
+		Driver::MemAccessMap run;
+
+		for ( size_t i = first; i < last; ++i )
+			run.insert( sorted[i] );
+
+		if ( driver_.setPageProtectionImpl( run, view ) ) {
+			updateCache( run, view );
+			applied.insert( run.begin(), run.end() );
+		} else {
+			Failure failure;
+
+			failure.view  = view;
+			failure.gfn   = sorted[first].first;
+			failure.count = last - first;
+			failure.error = errno;
+
+			failures.push_back( failure );
+			ret = false;
+		}
+
+		first = last;
+	}
+
+	return ret;
+}
+
+void ProtectionTransaction::updateCache( const Driver::MemAccessMap &accessMap, unsigned short view )
+{
+	for ( auto &&item : accessMap )
+		driver_.memAccessCache_->set( view, item.first, item.second );
+}
+
+} // namespace bdvmi
@@ -0,0 +1,76 @@
+// Copyright (c) 2019 Bitdefender SRL, All rights reserved.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 3.0 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library.
+
+#ifndef __BDVMISPSCQUEUE_H_INCLUDED__
+#define __BDVMISPSCQUEUE_H_INCLUDED__
+
+#include <atomic>
+#include <cstddef>
+
+namespace bdvmi {
+
+// Bounded lock-free queue for exactly one producer thread and one consumer thread
+template <typename T, size_t N> class SPSCQueue {
+
+	static_assert( N && !( N & ( N - 1 ) ), "SPSCQueue size must be a power of two" );
+
+public:
+	// Producer side, false if the queue is full
+	bool push( const T &item )
+	{
+		size_t tail = tail_.load( std::memory_order_relaxed );
+
+		if ( tail - head_.load( std::memory_order_acquire ) == N )
+			return false;
+
+		items_[tail & ( N - 1 )] = item;
+		tail_.store( tail + 1, std::memory_order_release );
+
+		return true;
+	}
+
+	// Consumer side, false if the queue is empty
+	bool pop( T &item )
+	{
+		size_t head = head_.load( std::memory_order_relaxed );
+
+		if ( head == tail_.load( std::memory_order_acquire ) )
+			return false;
+
+		item = items_[head & ( N - 1 )];
+		head_.store( head + 1, std::memory_order_release );
+
+		return true;
+	}
+
+	bool empty() const
+	{
+		return head_.load( std::memory_order_acquire ) == tail_.load( std::memory_order_acquire );
+	}
+
+private:
+	// Keep the two indices on different cache lines (plain padding, C++14 new doesn't do over-alignment)
+	static constexpr size_t CACHE_LINE = 64;
+
+	std::atomic<size_t> head_{ 0 };
+	char                headPad_[CACHE_LINE - sizeof( std::atomic<size_t> )];
+	std::atomic<size_t> tail_{ 0 };
+	char                tailPad_[CACHE_LINE - sizeof( std::atomic<size_t> )];
+	T                   items_[N];
+};
+
+} // namespace bdvmi
+
+#endif // __BDVMISPSCQUEUE_H_INCLUDED__
@@ -18,6 +18,8 @@
 #include "bdvmi/driver.h"
 #include "bdvmi/statscollector.h"
 
+#include <algorithm>
+#include <cerrno>
 #include <iomanip>
 #include <iostream>
 #include <cstring>
@@ -141,6 +143,7 @@ public:
 	std::function<xc_altp2m_switch_to_view_fn_t>          altp2mSwitchToView;
 	std::function<xc_altp2m_set_suppress_ve_fn_t>         altp2mSetSuppressVE;
 	std::function<xc_altp2m_get_suppress_ve_fn_t>         altp2mGetSuppressVE;
+	std::function<xc_altp2m_set_supress_ve_multi_fn_t>    altp2mSetSuppressVEMulti;
 	std::function<xc_altp2m_set_vcpu_enable_notify_fn_t>  altp2mSetVcpuEnableNotify;
 	std::function<xc_altp2m_set_vcpu_disable_notify_fn_t> altp2mSetVcpuDisableNotify;
 	std::function<xc_map_foreign_range_fn_t>              mapForeignRange;
@@ -269,6 +272,7 @@ XCFactory::XCFactory() : version{ getVersion() }, lib_{ "libxenctrl.so" }
 	altp2mSwitchToView         = LOOKUP_XC_FUNCTION_REQUIRED( altp2m_switch_to_view );
 	altp2mSetSuppressVE        = LOOKUP_XC_FUNCTION_OPTIONAL( altp2m_set_suppress_ve );
 	altp2mGetSuppressVE        = LOOKUP_XC_FUNCTION_OPTIONAL( altp2m_get_suppress_ve );
+	altp2mSetSuppressVEMulti   = LOOKUP_XC_FUNCTION_OPTIONAL( altp2m_set_supress_ve_multi );
 	altp2mSetVcpuEnableNotify  = LOOKUP_XC_FUNCTION_REQUIRED( altp2m_set_vcpu_enable_notify );
 	altp2mSetVcpuDisableNotify = LOOKUP_XC_FUNCTION_OPTIONAL( altp2m_set_vcpu_disable_notify );
 	mapForeignRange            = LOOKUP_XC_FUNCTION_REQUIRED( map_foreign_range );
@@ -313,6 +317,40 @@ std::function<T> XCFactoryImpl<T, name>::lookup( const XCFactory *p, bool requir
 	return p->lib_.lookup<T, name>( required );
 }
 
+// Calls fn( firstGfn, nr, access ) once per run of contiguous gfns sharing the same access, so that
+// xc_set_mem_access() can make use of its nr parameter. Keeps going after a failed run
+// and returns the first error, with errno preserved.
+template <typename Fn> int forEachMemAccessRun( const Driver::MemAccessMap &access, Fn fn )
+{
+	std::vector<std::pair<uint64_t, uint8_t>> sorted( access.begin(), access.end() );
+	std::sort( sorted.begin(), sorted.end() );
+
+	int ret        = 0;
+	int savedErrno = 0;
+
+	for ( size_t first = 0; first < sorted.size(); ) {
+		size_t last = first + 1;
+
+		while ( last < sorted.size() && sorted[last].first == sorted[last - 1].first + 1 &&
+		        sorted[last].second == sorted[first].second )
+			++last;
+
+		int err = fn( sorted[first].first, static_cast<uint32_t>( last - first ), sorted[first].second );
+
+		if ( err && !ret ) {
+			ret        = err;
+			savedErrno = errno;
+		}
+
+		first = last;
+	}
+
+	if ( ret )
+		errno = savedErrno;
+
+	return ret;
+}
+
 template <> struct XCFactoryImpl<xc_domain_getinfo_fn_t, xc_domain_getinfo_fn_name> {
 	static std::function<xc_domain_getinfo_fn_t> lookup( const XCFactory *p, bool )
 	{
@@ -390,13 +428,17 @@ template <> struct XCFactoryImpl<xc_set_mem_access_fn_t, xc_set_mem_access_fn_na
 		multi_fn_t *fun1 = p->lib_.lookup<multi_fn_t, xc_set_mem_access_multi_fn_name>( false );
 		if ( fun1 ) {
 			return [fun1]( xc_interface *xci, uint32_t domid, const Driver::MemAccessMap &access ) {
-				std::vector<uint8_t>  access_type;
-				std::vector<uint64_t> gfns;
+				std::vector<std::pair<uint64_t, uint8_t>> sorted( access.begin(), access.end() );
+				std::vector<uint8_t>                      access_type;
+				std::vector<uint64_t>                     gfns;
 
-				access_type.reserve( access.size() );
-				gfns.reserve( access.size() );
+				// Ascending gfns keep Xen walking the p2m in order (page classes flush whole ranges)
+				std::sort( sorted.begin(), sorted.end() );
 
-				for ( auto &&item : access ) {
+				access_type.reserve( sorted.size() );
+				gfns.reserve( sorted.size() );
+
+				for ( auto &&item : sorted ) {
 					access_type.push_back( XC::xenMemAccess( item.second ) );
 					gfns.push_back( item.first );
 				}
@@ -408,11 +450,10 @@ template <> struct XCFactoryImpl<xc_set_mem_access_fn_t, xc_set_mem_access_fn_na
 		using fn_t = int( xc_interface *, uint32_t, xenmem_access_t, uint64_t, uint32_t );
 		fn_t *fun2 = p->lib_.lookup<fn_t, xc_set_mem_access_fn_name>();
 		return [fun2]( xc_interface *xci, uint32_t domid, const Driver::MemAccessMap &access ) {
-			for ( auto &&item : access ) {
+			return forEachMemAccessRun( access, [&]( uint64_t first, uint32_t nr, uint8_t memaccess ) {
 				StatsCounter counter( "xcSetMemAccess" );
-				fun2( xci, domid, XC::xenMemAccess( item.second ), item.first, 1 );
-			}
-			return 0; // FIXME: value is ignored in the original code
+				return fun2( xci, domid, XC::xenMemAccess( memaccess ), first, nr );
+			} );
 		};
 	}
 };
@@ -420,18 +461,47 @@ template <> struct XCFactoryImpl<xc_set_mem_access_fn_t, xc_set_mem_access_fn_na
 template <> struct XCFactoryImpl<xc_altp2m_set_mem_access_fn_t, xc_altp2m_set_mem_access_fn_name> {
 	static std::function<xc_altp2m_set_mem_access_fn_t> lookup( const XCFactory *p, bool )
 	{
+		// Unlike xc_set_mem_access(), this one takes a single gfn and no count:
+		// int xc_altp2m_set_mem_access( xc_interface *, uint32_t domid, uint16_t view_id, xen_pfn_t gfn,
+		//                               xenmem_access_t access )
+		using fn_t = int( xc_interface *, uint32_t, uint16_t, xen_pfn_t, xenmem_access_t );
+		fn_t *fun2 = p->lib_.lookup<fn_t, xc_altp2m_set_mem_access_fn_name>();
+
 		using multi_fn_t = int( xc_interface *, uint16_t, uint32_t, uint8_t *, uint64_t *, uint32_t );
 		multi_fn_t *fun1 = p->lib_.lookup<multi_fn_t, xc_altp2m_set_mem_access_multi_fn_name>( false );
 		if ( fun1 ) {
-			return [fun1]( xc_interface *xci, uint32_t domid, uint16_t altp2mViewId,
-			               const Driver::MemAccessMap &access ) {
-				std::vector<uint8_t>  access_type;
-				std::vector<uint64_t> gfns;
+			return [fun1, fun2]( xc_interface *xci, uint32_t domid, uint16_t altp2mViewId,
+			                     const Driver::MemAccessMap &access ) {
+				std::vector<std::pair<uint64_t, uint8_t>> sorted;
+				std::vector<uint8_t>                      access_type;
+				std::vector<uint64_t>                     gfns;
 
-				access_type.reserve( access.size() );
-				gfns.reserve( access.size() );
+				sorted.reserve( access.size() );
 
 				for ( auto &&item : access ) {
+					// The multi call knows nothing of INVALID_GFN, the view's default access goes one at a time
+					if ( item.first == ~0ull ) {
+						StatsCounter counter( "xcSetMemAccess" );
+
+						int err = fun2( xci, domid, altp2mViewId, item.first, XC::xenMemAccess( item.second ) );
+						if ( err )
+							return err;
+						continue;
+					}
+
+					sorted.push_back( item );
+				}
+
+				if ( sorted.empty() )
+					return 0;
+
+				// Ascending gfns keep Xen walking the p2m in order (page classes flush whole ranges)
+				std::sort( sorted.begin(), sorted.end() );
+
+				access_type.reserve( sorted.size() );
+				gfns.reserve( sorted.size() );
+
+				for ( auto &&item : sorted ) {
 					access_type.push_back( XC::xenMemAccess( item.second ) );
 					gfns.push_back( item.first );
 				}
@@ -440,15 +510,26 @@ template <> struct XCFactoryImpl<xc_altp2m_set_mem_access_fn_t, xc_altp2m_set_me
 			};
 		}
 
-		using fn_t = int( xc_interface *, uint16_t, uint32_t, xenmem_access_t, uint64_t, uint32_t );
-		fn_t *fun2 = p->lib_.lookup<fn_t, xc_altp2m_set_mem_access_fn_name>();
 		return [fun2]( xc_interface *xci, uint32_t domid, uint16_t altp2mViewId,
 		               const Driver::MemAccessMap &access ) {
+			int ret        = 0;
+			int savedErrno = 0;
+
 			for ( auto &&item : access ) {
 				StatsCounter counter( "xcSetMemAccess" );
-				fun2( xci, domid, altp2mViewId, XC::xenMemAccess( item.second ), item.first, 1 );
+
+				int err = fun2( xci, domid, altp2mViewId, item.first, XC::xenMemAccess( item.second ) );
+
+				if ( err && !ret ) {
+					ret        = err;
+					savedErrno = errno;
+				}
 			}
-			return 0; // FIXME: value is ignored in the original code
+
+			if ( ret )
+				errno = savedErrno;
+
+			return ret;
 		};
 	}
 };
@@ -658,6 +739,10 @@ XC::XC()
 	if ( XCFactory::instance().altp2mGetSuppressVE )
 		altp2mGetSuppressVE =
 		        std::bind( XCFactory::instance().altp2mGetSuppressVE, xci_.get(), _1, _2, _3, _4 );
+
+	if ( XCFactory::instance().altp2mSetSuppressVEMulti )
+		altp2mSetSuppressVEMulti = std::bind( XCFactory::instance().altp2mSetSuppressVEMulti, xci_.get(), _1,
+		                                      _2, _3, _4, _5, _6, _7 );
 }
 
 xenmem_access_t XC::xenMemAccess( uint8_t bdvmiBitmask )
@@ -131,6 +131,9 @@ DECLARE_BDVMI_FUNCTION( altp2m_destroy_view, int( uint32_t, uint16_t ) )
 DECLARE_BDVMI_FUNCTION( altp2m_switch_to_view, int( uint32_t, uint16_t ) )
 DECLARE_BDVMI_FUNCTION( altp2m_set_suppress_ve, int( uint32_t, uint16_t, xen_pfn_t, bool ) )
 DECLARE_BDVMI_FUNCTION( altp2m_get_suppress_ve, int( uint32_t, uint16_t, xen_pfn_t, bool * ) )
+// Sic, that's how libxc spells it
+DECLARE_BDVMI_FUNCTION( altp2m_set_supress_ve_multi,
+                        int( uint32_t, uint16_t, xen_pfn_t, xen_pfn_t, bool, xen_pfn_t *, int32_t * ) )
 DECLARE_BDVMI_FUNCTION( altp2m_set_vcpu_enable_notify, int( uint32_t, uint32_t, xen_pfn_t ) )
 DECLARE_BDVMI_FUNCTION( altp2m_set_vcpu_disable_notify, int( uint32_t, uint32_t ) )
 DECLARE_BDVMI_FUNCTION( map_foreign_range, void *( uint32_t, int, int, unsigned long ))
@@ -201,6 +204,7 @@ public:
 	NCFunction<bdvmi_altp2m_switch_to_view_fn_t>          altp2mSwitchToView;
 	NCFunction<bdvmi_altp2m_set_suppress_ve_fn_t>         altp2mSetSuppressVE;
 	NCFunction<bdvmi_altp2m_get_suppress_ve_fn_t>         altp2mGetSuppressVE;
+	NCFunction<bdvmi_altp2m_set_supress_ve_multi_fn_t>    altp2mSetSuppressVEMulti;
 	NCFunction<bdvmi_altp2m_set_vcpu_enable_notify_fn_t>  altp2mSetVcpuEnableNotify;
 	NCFunction<bdvmi_altp2m_set_vcpu_disable_notify_fn_t> altp2mSetVcpuDisableNotify;
 
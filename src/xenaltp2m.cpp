@@ -148,4 +148,25 @@ int XenAltp2mDomainState::getSuppressVE( uint16_t view, xen_pfn_t gfn, bool &sve
 	return xc_.altp2mGetSuppressVE( domain_, view, gfn, &sve );
 }
 
+int XenAltp2mDomainState::setSuppressVEMulti( uint16_t view, xen_pfn_t first, xen_pfn_t last, bool sve,
+                                              xen_pfn_t &errorGfn )
+{
+	if ( !enabled_ || !xc_.altp2mSetSuppressVEMulti )
+		return -ENOTSUP;
+
+	if ( view && views_.find( view ) == views_.end() )
+		return -EINVAL;
+
+	int32_t errorCode = 0;
+	errorGfn          = 0;
+
+	int rc = xc_.altp2mSetSuppressVEMulti( domain_, view, first, last, sve, &errorGfn, &errorCode );
+
+	// Xen reports the first gfn it couldn't change separately from the hypercall's return code
+	if ( !rc && errorCode )
+		rc = errorCode < 0 ? errorCode : -errorCode;
+
+	return rc;
+}
+
 } // namespace bdvmi
@@ -50,6 +50,14 @@ public:
 
 	int getSuppressVE( uint16_t view, xen_pfn_t gfn, bool &sve );
 
+	// Set the bit for [first, last] with a single hypercall, -ENOTSUP if libxc can't do that
+	int setSuppressVEMulti( uint16_t view, xen_pfn_t first, xen_pfn_t last, bool sve, xen_pfn_t &errorGfn );
+
+	bool suppressVEMultiSupported() const
+	{
+		return enabled_ && !!xc_.altp2mSetSuppressVEMulti;
+	}
+
 	explicit operator bool() const
 	{
 		return enabled_;
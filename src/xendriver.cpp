@@ -226,12 +226,13 @@ bool XenDriver::getPageProtectionImpl( unsigned long long guestAddress, bool &re
 
 bool XenDriver::registers( unsigned short vcpu, Registers &regs ) const
 {
-	std::lock_guard<std::mutex> lock( regsCache_.mutex_ );
+	VcpuState &                 state = vcpuState( vcpu );
+	std::lock_guard<std::mutex> lock( state.mutex_ );
 
 	regs = Registers(); // Fill it up with default values.
 
-	if ( regsCache_.valid_ && regsCache_.vcpu_ == static_cast<int>( vcpu ) ) {
-		regs = regsCache_.registers_;
+	if ( state.cacheEnabled_ && state.valid_ ) {
+		regs = state.registers_;
 
 		if ( !getPAT( vcpu, regs.msr_pat ) )
 			return false;
@@ -341,33 +342,34 @@ bool XenDriver::registers( unsigned short vcpu, Registers &regs ) const
 			break;
 	}
 
-	if ( regsCache_.vcpu_ == static_cast<int>( vcpu ) ) {
-
-		if ( delayedWrite_.pending_ ) {
-			regs.rax = delayedWrite_.registers_.rax;
-			regs.rcx = delayedWrite_.registers_.rcx;
-			regs.rdx = delayedWrite_.registers_.rdx;
-			regs.rbx = delayedWrite_.registers_.rbx;
-			regs.rsp = delayedWrite_.registers_.rsp;
-			regs.rbp = delayedWrite_.registers_.rbp;
-			regs.rsi = delayedWrite_.registers_.rsi;
-			regs.rdi = delayedWrite_.registers_.rdi;
-
-			regs.r8  = delayedWrite_.registers_.r8;
-			regs.r9  = delayedWrite_.registers_.r9;
-			regs.r10 = delayedWrite_.registers_.r10;
-			regs.r11 = delayedWrite_.registers_.r11;
-			regs.r12 = delayedWrite_.registers_.r12;
-			regs.r13 = delayedWrite_.registers_.r13;
-			regs.r14 = delayedWrite_.registers_.r14;
-			regs.r15 = delayedWrite_.registers_.r15;
-
-			regs.rflags = delayedWrite_.registers_.rflags;
-			regs.rip    = delayedWrite_.registers_.rip;
+	if ( state.cacheEnabled_ ) {
+		const DelayedWrite &dw = state.delayedWrite_;
+
+		if ( dw.pending_ ) {
+			regs.rax = dw.registers_.rax;
+			regs.rcx = dw.registers_.rcx;
+			regs.rdx = dw.registers_.rdx;
+			regs.rbx = dw.registers_.rbx;
+			regs.rsp = dw.registers_.rsp;
+			regs.rbp = dw.registers_.rbp;
+			regs.rsi = dw.registers_.rsi;
+			regs.rdi = dw.registers_.rdi;
+
+			regs.r8  = dw.registers_.r8;
+			regs.r9  = dw.registers_.r9;
+			regs.r10 = dw.registers_.r10;
+			regs.r11 = dw.registers_.r11;
+			regs.r12 = dw.registers_.r12;
+			regs.r13 = dw.registers_.r13;
+			regs.r14 = dw.registers_.r14;
+			regs.r15 = dw.registers_.r15;
+
+			regs.rflags = dw.registers_.rflags;
+			regs.rip    = dw.registers_.rip;
 		}
 
-		regsCache_.registers_ = regs;
-		regsCache_.valid_     = true;
+		state.registers_ = regs;
+		state.valid_     = true;
 	}
 
 	return true;
@@ -375,7 +377,8 @@ bool XenDriver::registers( unsigned short vcpu, Registers &regs ) const
 
 bool XenDriver::setRegisters( unsigned short vcpu, const Registers &regs, bool setEip, bool delay )
 {
-	std::lock_guard<std::mutex> lock( regsCache_.mutex_ );
+	VcpuState &                 state = vcpuState( vcpu );
+	std::lock_guard<std::mutex> lock( state.mutex_ );
 
 	if ( !delay ) {
 		if ( xc_.vcpuSetRegisters( domain_, vcpu, regs, setEip ) != 0 ) {
@@ -383,37 +386,39 @@ bool XenDriver::setRegisters( unsigned short vcpu, const Registers &regs, bool s
 			return false;
 		}
 	} else {
-		delayedWrite_.registers_ = regs;
+		state.delayedWrite_.registers_ = regs;
 
 		if ( !setEip )
-			delayedWrite_.registers_.rip = regs.rip + 3; // 3 is the size of the VMCALL opcodes
+			state.delayedWrite_.registers_.rip = regs.rip + 3; // 3 is the size of the VMCALL opcodes
 
-		delayedWrite_.pending_ = true;
+		state.delayedWrite_.pending_ = true;
 	}
 
-	if ( regsCache_.valid_ && regsCache_.vcpu_ == static_cast<int>( vcpu ) ) {
-		regsCache_.registers_.rax = regs.rax;
-		regsCache_.registers_.rcx = regs.rcx;
-		regsCache_.registers_.rdx = regs.rdx;
-		regsCache_.registers_.rbx = regs.rbx;
-		regsCache_.registers_.rsp = regs.rsp;
-		regsCache_.registers_.rbp = regs.rbp;
-		regsCache_.registers_.rsi = regs.rsi;
-		regsCache_.registers_.rdi = regs.rdi;
-
-		regsCache_.registers_.r8  = regs.r8;
-		regsCache_.registers_.r9  = regs.r9;
-		regsCache_.registers_.r10 = regs.r10;
-		regsCache_.registers_.r11 = regs.r11;
-		regsCache_.registers_.r12 = regs.r12;
-		regsCache_.registers_.r13 = regs.r13;
-		regsCache_.registers_.r14 = regs.r14;
-		regsCache_.registers_.r15 = regs.r15;
-
-		regsCache_.registers_.rflags = regs.rflags;
+	if ( state.cacheEnabled_ && state.valid_ ) {
+		Registers &cached = state.registers_;
+
+		cached.rax = regs.rax;
+		cached.rcx = regs.rcx;
+		cached.rdx = regs.rdx;
+		cached.rbx = regs.rbx;
+		cached.rsp = regs.rsp;
+		cached.rbp = regs.rbp;
+		cached.rsi = regs.rsi;
+		cached.rdi = regs.rdi;
+
+		cached.r8  = regs.r8;
+		cached.r9  = regs.r9;
+		cached.r10 = regs.r10;
+		cached.r11 = regs.r11;
+		cached.r12 = regs.r12;
+		cached.r13 = regs.r13;
+		cached.r14 = regs.r14;
+		cached.r15 = regs.r15;
+
+		cached.rflags = regs.rflags;
 
 		if ( setEip )
-			regsCache_.registers_.rip = regs.rip;
+			cached.rip = regs.rip;
 	}
 
 	return true;
@@ -453,6 +458,9 @@ void XenDriver::init( domid_t domain, bool hvmOnly )
 
 	uuid_ = queryUuid( xs_, std::to_string( domain_ ) );
 
+	vcpuCount_  = info.max_vcpu_id + 1;
+	vcpuStates_.reset( new VcpuState[vcpuCount_] );
+
 	if ( altp2mState_ ) {
 		if ( altp2mState_.createView( XENMEM_access_rwx, altp2mViewId_ ) < 0 )
 			throw std::runtime_error( "[ALTP2M] could not create altp2m view" );
@@ -576,7 +584,10 @@ bool XenDriver::requestPageFault( int vcpu, uint64_t /* addressSpace */, uint64_
 		return false;
 	}
 
-	pendingInjections_[vcpu] = true;
+	VcpuState &                 state = vcpuState( vcpu );
+	std::lock_guard<std::mutex> lock( state.mutex_ );
+
+	state.pendingInjection_ = true;
 
 	return true;
 }
@@ -994,6 +1005,37 @@ bool XenDriver::setPageConvertibleImpl( const ConvertibleMap &convMap, unsigned
 	if ( !altp2mState_ )
 		return false;
 
+	if ( altp2mState_.suppressVEMultiSupported() ) {
+		std::vector<std::pair<uint64_t, bool>> sorted( convMap.begin(), convMap.end() );
+		std::sort( sorted.begin(), sorted.end() );
+
+		// One hypercall per run of contiguous gfns that want the same bit
+		for ( size_t first = 0; first < sorted.size(); ) {
+			size_t last = first + 1;
+
+			while ( last < sorted.size() && sorted[last].first == sorted[last - 1].first + 1 &&
+			        sorted[last].second == sorted[first].second )
+				++last;
+
+			xen_pfn_t errorGfn = 0;
+
+			StatsCounter counter( "xcAltp2mSetSuppressVEMulti" );
+
+			int rc = altp2mState_.setSuppressVEMulti( view, sorted[first].first, sorted[last - 1].first,
+			                                          sorted[first].second, errorGfn );
+
+			if ( rc < 0 ) {
+				logger << ERROR << "Failed to write the convertible bit (gfn " << std::hex << std::showbase
+				       << errorGfn << "): " << strerror( -rc ) << std::flush;
+				return false;
+			}
+
+			first = last;
+		}
+
+		return true;
+	}
+
 	for ( auto &&item : convMap ) {
 		int rc = altp2mState_.setSuppressVE( view, item.first, item.second );
 
@@ -1016,6 +1058,18 @@ bool XenDriver::createEPT( unsigned short &index )
 	if ( altp2mState_.createView( XENMEM_access_rwx, viewId ) < 0 )
 		return false;
 
+	// Older Xen ignores the access given at creation and copies the host's default, so set it explicitly
+	// (~0 being INVALID_GFN, i.e. the view's default access)
+	MemAccessMap defaultAccess;
+	defaultAccess[~0ull] = PAGE_READ | PAGE_WRITE | PAGE_EXECUTE;
+
+	if ( xc_.altp2mSetMemAccess( domain_, viewId, defaultAccess ) < 0 ) {
+		logger << ERROR << "Could not set the default access of altp2m view " << viewId << ": " << strerror( errno )
+		       << std::flush;
+		altp2mState_.destroyView( viewId );
+		return false;
+	}
+
 	index = viewId;
 
 	return true;
@@ -1074,31 +1128,61 @@ bool XenDriver::disableVE( unsigned short vcpu )
 
 void XenDriver::enableCache( unsigned short vcpu )
 {
-	std::lock_guard<std::mutex> lock( regsCache_.mutex_ );
-	regsCache_.vcpu_  = vcpu;
-	regsCache_.valid_ = false;
+	VcpuState &                 state = vcpuState( vcpu );
+	std::lock_guard<std::mutex> lock( state.mutex_ );
+
+	state.cacheEnabled_ = true;
+	state.valid_        = false;
+}
+
+void XenDriver::disableCache( unsigned short vcpu )
+{
+	VcpuState &                 state = vcpuState( vcpu );
+	std::lock_guard<std::mutex> lock( state.mutex_ );
+
+	state.cacheEnabled_ = false;
+	state.valid_        = false;
 }
 
 void XenDriver::disableCache()
 {
-	std::lock_guard<std::mutex> lock( regsCache_.mutex_ );
-	regsCache_.vcpu_  = -1;
-	regsCache_.valid_ = false;
+	for ( unsigned int vcpu = 0; vcpu < vcpuCount_; ++vcpu )
+		disableCache( vcpu );
+
+	std::lock_guard<std::mutex> lock( spareVcpuState_.mutex_ );
+
+	spareVcpuState_.cacheEnabled_ = false;
+	spareVcpuState_.valid_        = false;
 }
 
-bool XenDriver::pendingInjection( unsigned short vcpu ) const
+bool XenDriver::takeDelayedWrite( unsigned short vcpu, Registers &regs )
 {
-	auto i = pendingInjections_.find( vcpu );
+	VcpuState &                 state = vcpuState( vcpu );
+	std::lock_guard<std::mutex> lock( state.mutex_ );
 
-	if ( i == pendingInjections_.end() )
+	if ( !state.delayedWrite_.pending_ )
 		return false;
 
-	return i->second;
+	regs                         = state.delayedWrite_.registers_;
+	state.delayedWrite_.pending_ = false;
+
+	return true;
+}
+
+bool XenDriver::pendingInjection( unsigned short vcpu ) const
+{
+	VcpuState &                 state = vcpuState( vcpu );
+	std::lock_guard<std::mutex> lock( state.mutex_ );
+
+	return state.pendingInjection_;
 }
 
 void XenDriver::clearInjection( unsigned short vcpu )
 {
-	pendingInjections_[vcpu] = false;
+	VcpuState &                 state = vcpuState( vcpu );
+	std::lock_guard<std::mutex> lock( state.mutex_ );
+
+	state.pendingInjection_ = false;
 }
 
 uint32_t XenDriver::startTime()
@@ -17,6 +17,7 @@
 #define __BDVMIXENDRIVER_H_INCLUDED__
 
 #include <list>
+#include <memory>
 #include <set>
 #include <string>
 #include <unordered_map>
@@ -33,19 +34,24 @@ namespace bdvmi {
 
 class XenDriver : public Driver {
 
-	struct RegsCache {
-		Registers  registers_;
-		int        vcpu_{ -1 };
-		bool       valid_{ false };
-		std::mutex mutex_;
-	};
-
 public:
 	struct DelayedWrite {
 		Registers registers_;
 		bool      pending_{ false };
 	};
 
+private:
+	// Everything an event touches on the driver side, one per vcpu so that events coming
+	// from different vcpus can be handled at the same time
+	struct VcpuState {
+		Registers    registers_;
+		bool         cacheEnabled_{ false };
+		bool         valid_{ false };
+		DelayedWrite delayedWrite_;
+		bool         pendingInjection_{ false };
+		std::mutex   mutex_;
+	};
+
 public:
 	// Create a XenDriver object with the domain name
 	XenDriver( const std::string &uuid, bool altp2m, bool hvmOnly = true );
@@ -120,8 +126,11 @@ public:
 
 	void enableCache( unsigned short vcpu ) override;
 
+	// Disables the registers cache for all vcpus
 	void disableCache() override;
 
+	void disableCache( unsigned short vcpu );
+
 	uint32_t startTime() override;
 
 	bool isMsrCached( uint64_t msr ) const override;
@@ -170,10 +179,8 @@ public: // Xen specific-stuff
 public:
 	static int32_t guestX86Mode( const Registers &regs );
 
-	DelayedWrite &delayedWrite()
-	{
-		return delayedWrite_;
-	}
+	// Hand over the registers setRegisters() delayed for vcpu (if any) and forget about them
+	bool takeDelayedWrite( unsigned short vcpu, Registers &regs );
 
 	bool pendingInjection( unsigned short vcpu ) const;
 
@@ -205,6 +212,11 @@ private:
 
 	static std::string queryUuid( XS &xs, const std::string &domain );
 
+	VcpuState &vcpuState( unsigned short vcpu ) const
+	{
+		return vcpu < vcpuCount_ ? vcpuStates_[vcpu] : spareVcpuState_;
+	}
+
 private:
 	mutable XS        xs_;
 	mutable XC        xc_;
@@ -212,10 +224,10 @@ private:
 	PageCache         pageCache_;
 	std::string       uuid_;
 	uint16_t          altp2mViewId_{ 0 };
-	mutable RegsCache regsCache_;
 	bool              update_{ false };
-	DelayedWrite      delayedWrite_;
-	std::unordered_map<unsigned short, bool> pendingInjections_;
+	std::unique_ptr<VcpuState[]> vcpuStates_;
+	unsigned int                 vcpuCount_{ 0 };
+	mutable VcpuState            spareVcpuState_; // for vcpu IDs beyond what the domain had at startup
 	uint32_t             startTime_{ static_cast<uint32_t>( -1 ) };
 	mutable bool         patInitialized_{ false };
 	mutable uint64_t     msrPat_{ 0 };
@@ -15,20 +15,34 @@
 
 #define BDVMI_DISABLE_STATS
 
+#include "bdvmi/event.h"
+#include "bdvmi/registerview.h"
 #include "bdvmi/statscollector.h"
+#include "spscqueue.h"
 #include "xendriver.h"
 #include "xeneventmanager.h"
 #include "xenvmevent_v3.h"
 #include "xenvmevent_v4.h"
 #include "xenvmevent_v5.h"
+#include "xenvmevent_v6.h"
 #include "bdvmi/logger.h"
+#include <sys/eventfd.h>
 #include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <emmintrin.h>
 #include <poll.h>
+#include <algorithm>
+#include <condition_variable>
+#include <future>
+#include <thread>
 #include <errno.h>
 #include <cstring>
 #include <cstdlib>
 #include <iomanip>
+#include <new>
 #include <stdexcept>
+#include <type_traits>
 
 #define GLA_VALID( x ) ( x.u.mem_access.flags & MEM_ACCESS_GLA_VALID )
 #define ACCESS_R( x ) ( x.u.mem_access.flags & MEM_ACCESS_R )
@@ -39,18 +53,106 @@
 #define HVMOP_TRAP_sw_exc 6
 #endif
 
+/* vm_event v6 (Xen 4.14): switch back to u.fast_singlestep.p2midx after one step, without a singlestep event */
+#ifndef VM_EVENT_FLAG_FAST_SINGLESTEP
+#define VM_EVENT_FLAG_FAST_SINGLESTEP ( 1 << 11 )
+#endif
+
 /* From xen/include/asm-x86/x86-defns.h */
 #define X86_CR4_PGE 0x00000080 /* enable global pages */
 #define X86_TRAP_INT3 3
 
 namespace bdvmi {
 
+struct XenEventManager::QueuedRequest {
+	alignas( 8 ) unsigned char data[std::max( { sizeof( vm_event_request_v3_t ), sizeof( vm_event_request_v4_t ),
+	                                            sizeof( vm_event_request_v5_t ),
+	                                            sizeof( vm_event_request_v6_t ) } )];
+};
+
+struct XenEventManager::DispatchWorker {
+	SPSCQueue<QueuedRequest, 64> queue_;
+	std::thread                  thread_;
+	std::mutex                   mutex_;
+	std::condition_variable      cv_;
+	std::atomic<bool>            sleeping_{ false };
+	std::atomic<bool>            full_{ false }; // the event thread is waiting for room in queue_
+	std::atomic<bool>            stop_{ false };
+	std::atomic<bool>            exited_{ false };
+};
+
+struct XenEventManager::ParkedResponse {
+	enum State { REQUESTED, PARKED, COMPLETED };
+
+	State           state{ REQUESTED };
+	bool            skip{ false };
+	HVAction        action{ NONE };
+	EmulatorContext emulatorCtx;
+	unsigned short  instructionSize{ 0 };
+	QueuedRequest   request;
+	QueuedRequest   response; // same layout and size as the request
+};
+
+namespace {
+
+// The event being handled on this thread, so that deferResponse() can check where it's called from
+struct CurrentEvent {
+	const void *                manager{ nullptr };
+	unsigned short              vcpu{ 0 };
+	bool                        inCallback{ false };
+	EventManager::ResponseToken token{ 0 };
+};
+
+thread_local CurrentEvent currentEvent;
+
+// The event manager this thread is acting as the event thread of (in its loop, or running commands), if any.
+// Dispatch workers are not: what they hand to the event thread goes through postCommand().
+thread_local const void *eventThreadOwner = nullptr;
+
+} // end of anonymous namespace
+
+struct XenEventManager::EventThreadScope {
+	// loop: a run of the event loop, otherwise commands or a call made while no loop is running.
+	// acquired: acquireEventThread() has already been done for us.
+	EventThreadScope( XenEventManager &manager, bool loop, bool acquired = false )
+	    : manager_{ manager }, loop_{ loop }, owns_{ eventThreadOwner != &manager }, previous_{ eventThreadOwner }
+	{
+		if ( owns_ && !acquired )
+			manager_.acquireEventThread( loop_, false );
+
+		eventThreadOwner = &manager;
+	}
+
+	~EventThreadScope()
+	{
+		if ( owns_ )
+			manager_.releaseEventThread( loop_ );
+
+		eventThreadOwner = previous_;
+	}
+
+	XenEventManager &manager_;
+	bool             loop_;
+	bool             owns_;
+	const void *     previous_;
+};
+
 XenEventManager::XenEventManager( XenDriver &driver, sig_atomic_t &sigStop )
     : EventManager{ sigStop }, driver_{ driver }, xc_{ driver_.nativeHandle() },
       domain_{ static_cast<domid_t>( driver.id() ) }
 {
 	initXenStore();
 
+	wakeFd_   = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+	xsStopFd_ = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+	timerFd_  = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+
+	if ( wakeFd_ < 0 || xsStopFd_ < 0 || timerFd_ < 0 ) {
+		cleanup();
+		throw std::runtime_error( std::string( "[Xen events] eventfd() / timerfd_create() failed: " ) +
+		                          strerror( errno ) );
+	}
+
 #ifndef DISABLE_MEM_EVENT
 	/*
 	if ( xc_.monitorSinglestep( domain_, 1 ) < 0 ) {
@@ -69,38 +171,41 @@ XenEventManager::XenEventManager( XenDriver &driver, sig_atomic_t &sigStop )
 	std::string eventsFile = "/tmp/" + driver.uuid() + ".events";
 	eventsFile_.open( eventsFile.c_str(), std::ios_base::out | std::ios_base::trunc );
 #endif
+
+	// Last, so that nothing above has to stop it on failure
+	xsThread_ = std::thread( &XenEventManager::watchXenStore, this );
 }
 
 XenEventManager::~XenEventManager()
 {
+	stopXenStoreWatcher();
+
 	handler( nullptr );
 	stop();
 
+	releaseParkedResponses();
+
 	disableVMCALLEvents();
 	disableBreakpointEvents();
 
 	// cleanup events
 	try {
-		constexpr int CLEANUP_TRIES = 10;
-
-		// Loop until no more events are found in CLEANUP_TRIES ...
-		do {
-			foundEvents_ = false;
-
-			for ( int i = 0; i < CLEANUP_TRIES; ++i )
-				waitForEvents();
-
-		} while ( foundEvents_ );
-
-		// ... then one more batch just for safety.
-		for ( int i = 0; i < CLEANUP_TRIES; ++i )
-			waitForEvents();
+		drainEvents();
 	} catch ( const std::exception &e ) {
 		logger << WARNING << e.what() << std::flush;
 	} catch ( ... ) {
 		// std::runtime_errors not allowed to escape destructors
 	}
 
+	stopWorkers();
+
+	// Only now, the drain has brought back any vcpu that was still stepping in it
+	releaseSinglestepView();
+
+	if ( spins_ )
+		logger << INFO << "Busy poll: " << spins_ << " spins, " << spinHits_ << " found requests, " << sleeps_
+		       << " sleeps" << std::flush;
+
 	cleanup();
 }
 
@@ -130,12 +235,30 @@ void XenEventManager::cleanup()
 		xc_.evtchnClose( xce_ );
 #endif // DISABLE_MEM_EVENT
 
+	if ( wakeFd_ >= 0 ) {
+		close( wakeFd_ );
+		wakeFd_ = -1;
+	}
+
+	if ( xsStopFd_ >= 0 ) {
+		close( xsStopFd_ );
+		xsStopFd_ = -1;
+	}
+
+	if ( timerFd_ >= 0 ) {
+		close( timerFd_ );
+		timerFd_ = -1;
+	}
+
 	xs_.unwatch( "@releaseDomain", watchToken_ );
 	xs_.unwatch( watchToken_, watchToken_ );
 	xs_.unwatch( controlXenStorePath_, watchToken_ );
 	xs_.rm( XS::xbtNull, controlXenStorePath_ );
 
 	switch ( vmEventInterfaceVersion_ ) {
+	case 6:
+		delete static_cast<vm_event_v6_back_ring_t *>( backRing_ );
+		break;
 	case 5:
 		delete static_cast<vm_event_v5_back_ring_t *>( backRing_ );
 		break;
@@ -149,27 +272,25 @@ void XenEventManager::cleanup()
 
 bool XenEventManager::enableMsrEventsImpl( unsigned int msr )
 {
-	return ( xc_.monitorMovToMsr( domain_, msr, 1, true ) == 0 );
+	return runOnEventThread( [this, msr]() { return xc_.monitorMovToMsr( domain_, msr, 1, true ) == 0; } );
 }
 
 bool XenEventManager::disableMsrEventsImpl( unsigned int msr )
 {
-	return ( xc_.monitorMovToMsr( domain_, msr, 0, true ) == 0 );
+	return runOnEventThread( [this, msr]() { return xc_.monitorMovToMsr( domain_, msr, 0, true ) == 0; } );
 }
 
-bool XenEventManager::setCrEvents( unsigned int cr, bool enable )
+bool XenEventManager::setCrEvents( unsigned int cr, bool enable, uint64_t ignoredBits, bool sync, bool onChangeOnly )
 {
 	uint16_t index;
 	bool     retval;
-	uint64_t bitmask = 0;
 
 	switch ( cr ) {
 		case 0:
 			index = VM_EVENT_X86_CR0;
 			break;
 		case 4:
-			index   = VM_EVENT_X86_CR4;
-			bitmask = X86_CR4_PGE;
+			index = VM_EVENT_X86_CR4;
 			break;
 		case 3:
 			index = VM_EVENT_X86_CR3;
@@ -178,7 +299,12 @@ bool XenEventManager::setCrEvents( unsigned int cr, bool enable )
 			return false; // Unsupported CR index
 	}
 
-	retval = xc_.monitorWriteCtrlreg( domain_, index, enable, 1, bitmask, 1 );
+	// Older libxc has no mask parameter, the wrapper just drops it
+	if ( enable && ignoredBits && xc_.version < Version( 4, 10 ) )
+		logger << WARNING << "CR" << cr << " write masks need Xen 4.10, all writes will be reported"
+		       << std::flush;
+
+	retval = xc_.monitorWriteCtrlreg( domain_, index, enable, sync, ignoredBits, onChangeOnly );
 
 	if ( retval ) {
 		logger << ERROR << "[Xen events] could not set up CR" << cr << " event handler" << std::flush;
@@ -190,42 +316,58 @@ bool XenEventManager::setCrEvents( unsigned int cr, bool enable )
 
 bool XenEventManager::enableCrEventsImpl( unsigned int cr )
 {
-	return setCrEvents( cr, true );
+	// CR4.PGE gets flipped to flush the TLB, that's just noise
+	return runOnEventThread( [this, cr]() {
+		return setCrEvents( cr, true, cr == 4 ? X86_CR4_PGE : 0, !asyncEvents( BDVMI_EVENT_CR ), true );
+	} );
+}
+
+bool XenEventManager::enableCrEventsImpl( unsigned int cr, uint64_t watchedBits, bool sync, bool onChangeOnly )
+{
+	// Xen takes the bits to ignore
+	return runOnEventThread(
+	        [=]() { return setCrEvents( cr, true, ~watchedBits, sync, onChangeOnly ); } );
 }
 
 bool XenEventManager::disableCrEventsImpl( unsigned int cr )
 {
-	return setCrEvents( cr, false );
+	return runOnEventThread( [this, cr]() { return setCrEvents( cr, false, 0, true, true ); } );
 }
 
 bool XenEventManager::enableXSETBVEventsImpl()
 {
-	return ( xc_.monitorWriteCtrlreg( domain_, VM_EVENT_X86_XCR0, 1, 1, 0, 1 ) == 0 );
+	return runOnEventThread( [this]() {
+		return xc_.monitorWriteCtrlreg( domain_, VM_EVENT_X86_XCR0, 1, !asyncEvents( BDVMI_EVENT_XSETBV ), 0,
+		                                1 ) == 0;
+	} );
 }
 
 bool XenEventManager::disableXSETBVEventsImpl()
 {
-	return ( xc_.monitorWriteCtrlreg( domain_, VM_EVENT_X86_XCR0, 0, 1, 0, 1 ) == 0 );
+	return runOnEventThread(
+	        [this]() { return xc_.monitorWriteCtrlreg( domain_, VM_EVENT_X86_XCR0, 0, 1, 0, 1 ) == 0; } );
 }
 
 bool XenEventManager::enableBreakpointEventsImpl()
 {
-	return ( xc_.monitorSoftwareBreakpoint( domain_, 1 ) == 0 );
+	return runOnEventThread( [this]() { return xc_.monitorSoftwareBreakpoint( domain_, 1 ) == 0; } );
 }
 
 bool XenEventManager::disableBreakpointEventsImpl()
 {
-	return ( xc_.monitorSoftwareBreakpoint( domain_, 0 ) == 0 );
+	return runOnEventThread( [this]() { return xc_.monitorSoftwareBreakpoint( domain_, 0 ) == 0; } );
 }
 
 bool XenEventManager::enableVMCALLEventsImpl()
 {
-	return ( xc_.monitorGuestRequest( domain_, true, true, true ) == 0 );
+	return runOnEventThread( [this]() {
+		return xc_.monitorGuestRequest( domain_, true, !asyncEvents( BDVMI_EVENT_VMCALL ), true ) == 0;
+	} );
 }
 
 bool XenEventManager::disableVMCALLEventsImpl()
 {
-	return ( xc_.monitorGuestRequest( domain_, false, true, true ) == 0 );
+	return runOnEventThread( [this]() { return xc_.monitorGuestRequest( domain_, false, true, true ) == 0; } );
 }
 
 bool XenEventManager::enableDescriptorEventsImpl()
@@ -235,7 +377,7 @@ bool XenEventManager::enableDescriptorEventsImpl()
 		return false;
 	}
 
-	return ( xc_.monitorDescriptorAccess( domain_, true ) == 0 );
+	return runOnEventThread( [this]() { return xc_.monitorDescriptorAccess( domain_, true ) == 0; } );
 }
 
 bool XenEventManager::disableDescriptorEventsImpl()
@@ -245,7 +387,120 @@ bool XenEventManager::disableDescriptorEventsImpl()
 		return false;
 	}
 
-	return ( xc_.monitorDescriptorAccess( domain_, false ) == 0 );
+	return runOnEventThread( [this]() { return xc_.monitorDescriptorAccess( domain_, false ) == 0; } );
+}
+
+template <typename Fn> bool XenEventManager::runOnEventThread( Fn fn )
+{
+	if ( eventThreadOwner == this )
+		return fn();
+
+	// No loop, so run it here, but not at the same time as an EventReactor pass or another caller
+	if ( acquireEventThread( false, true ) ) {
+		EventThreadScope scope( *this, false, true );
+		return fn();
+	}
+
+	auto              promise = std::make_shared<std::promise<bool>>();
+	std::future<bool> result  = promise->get_future();
+
+	postCommand( [promise, fn]() {
+		try {
+			promise->set_value( fn() );
+		} catch ( ... ) {
+			promise->set_exception( std::current_exception() );
+		}
+	} );
+
+	return result.get();
+}
+
+void XenEventManager::postCommand( std::function<void()> command )
+{
+	commands_.push( std::move( command ) );
+	wake();
+
+	{
+		// For waitServingCommands()
+		std::lock_guard<std::mutex> guard( serveMutex_ );
+	}
+	serveCv_.notify_all();
+
+	// This thread is already it, the command runs when its scope ends
+	if ( eventThreadOwner == this )
+		return;
+
+	// No loop to run it, then it's up to us (the scope runs the commands on its way out)
+	if ( acquireEventThread( false, true ) )
+		EventThreadScope scope( *this, false, true );
+}
+
+bool XenEventManager::acquireEventThread( bool loop, bool handOff )
+{
+	std::unique_lock<std::mutex> lock( eventThreadMutex_ );
+
+	eventThreadCv_.wait( lock, [&]() { return !eventThreadBusy_ || ( handOff && loopRunning_ ); } );
+
+	if ( eventThreadBusy_ )
+		return false; // a loop is running, it will see to the commands
+
+	eventThreadBusy_ = true;
+
+	if ( loop ) {
+		loopRunning_ = true;
+		lock.unlock();
+		eventThreadCv_.notify_all(); // the ones waiting to hand off can post now
+	}
+
+	return true;
+}
+
+void XenEventManager::releaseEventThread( bool loop )
+{
+	if ( loop ) {
+		std::lock_guard<std::mutex> guard( eventThreadMutex_ );
+		loopRunning_ = false;
+	}
+
+	// Whatever got posted while we were on our way out (commands posting more included). Posters
+	// that found no loop running are waiting for us to be done, anything later gets run by them.
+	while ( !commands_.empty() )
+		runCommands();
+
+	{
+		std::lock_guard<std::mutex> guard( eventThreadMutex_ );
+		eventThreadBusy_ = false;
+	}
+
+	eventThreadCv_.notify_all();
+}
+
+void XenEventManager::runCommands()
+{
+	// Only ever called on the event thread, so one thread drains at a time
+	commands_.drain( []( std::function<void()> &command ) { command(); } );
+}
+
+template <typename Done> void XenEventManager::waitServingCommands( Done done )
+{
+	std::unique_lock<std::mutex> lock( serveMutex_ );
+
+	while ( !done() ) {
+		if ( !commands_.empty() ) {
+			lock.unlock();
+			runCommands();
+			lock.lock();
+			continue;
+		}
+
+		serveCv_.wait( lock );
+	}
+}
+
+void XenEventManager::wake()
+{
+	if ( eventfd_write( wakeFd_, 1 ) < 0 )
+		logger << ERROR << "[Xen events] could not wake up the event loop: " << strerror( errno ) << std::flush;
 }
 
 void copySegmentRegisters( Registers &regs, const vm_event_request_v3_t &req )
@@ -263,6 +518,24 @@ void copySegmentRegisters( Registers &regs, const vm_event_request_v5_t &req )
 	regs.cs_arbytes = req.data.regs.x86.cs.ar;
 }
 
+void copySegmentRegisters( Registers &regs, const vm_event_request_v6_t &req )
+{
+	regs.cs_arbytes = req.data.regs.x86.cs.ar;
+}
+
+// Only v6 responses say which view to go back to after a fast singlestep
+template <typename Response> bool setFastSinglestep( Response & /* rsp */, uint16_t /* view */ )
+{
+	return false;
+}
+
+bool setFastSinglestep( vm_event_response_v6_t &rsp, uint16_t view )
+{
+	rsp.flags |= VM_EVENT_FLAG_FAST_SINGLESTEP;
+	rsp.u.fast_singlestep.p2midx = view;
+	return true;
+}
+
 template <typename Request> inline void copyRegisters( Registers &regs, const Request &req )
 {
 	regs.sysenter_cs  = req.data.regs.x86.sysenter_cs;
@@ -322,44 +595,117 @@ template <typename Request> inline void copyRegisters( Registers &regs, const Re
 	}
 }
 
-template <typename Response> void XenEventManager::setRegisters( Response &rsp )
+// Registers straight out of the request, only copied into a Registers object when somebody asks for all of them
+template <typename Request> class XenRegisterView final : public RegisterView {
+
+public:
+	explicit XenRegisterView( const Request &req ) : req_( req )
+	{
+	}
+
+public:
+	uint64_t rip() const override
+	{
+		return req_.data.regs.x86.rip;
+	}
+
+	uint64_t rsp() const override
+	{
+		return req_.data.regs.x86.rsp;
+	}
+
+	uint64_t rflags() const override
+	{
+		return req_.data.regs.x86.rflags;
+	}
+
+	uint64_t cr0() const override
+	{
+		return req_.data.regs.x86.cr0;
+	}
+
+	uint64_t cr3() const override
+	{
+		return req_.data.regs.x86.cr3;
+	}
+
+	uint64_t cr4() const override
+	{
+		return req_.data.regs.x86.cr4;
+	}
+
+	uint64_t msrEfer() const override
+	{
+		return req_.data.regs.x86.msr_efer;
+	}
+
+	const Registers &registers() const override
+	{
+		// Registers is trivially destructible, so there's no matching destructor call
+		if ( !regs_ ) {
+			regs_ = new ( &storage_ ) Registers;
+			copyRegisters( *regs_, req_ );
+		}
+
+		return *regs_;
+	}
+
+private:
+	const Request &req_;
+	mutable typename std::aligned_storage<sizeof( Registers ), alignof( Registers )>::type storage_;
+	mutable Registers *regs_{ nullptr };
+};
+
+template <typename Request, typename Response>
+void XenEventManager::prepareSetRegisters( const Request &req, Response &rsp )
+{
+	// Responses only carry register state when it's about to be used, so start from the
+	// request's registers the first time something is written there.
+	if ( !( rsp.flags & VM_EVENT_FLAG_SET_REGISTERS ) )
+		rsp.data.regs.x86 = req.data.regs.x86;
+}
+
+template <typename Request, typename Response> void XenEventManager::setRegisters( const Request &req, Response &rsp )
 {
-	XenDriver::DelayedWrite &dw = driver_.delayedWrite();
+	Registers regs;
 
-	if ( !dw.pending_ )
+	if ( !driver_.takeDelayedWrite( req.vcpu_id, regs ) )
 		return;
 
-	rsp.data.regs.x86.rflags = dw.registers_.rflags;
-	rsp.data.regs.x86.rax    = dw.registers_.rax;
-	rsp.data.regs.x86.rcx    = dw.registers_.rcx;
-	rsp.data.regs.x86.rdx    = dw.registers_.rdx;
-	rsp.data.regs.x86.rbx    = dw.registers_.rbx;
-	rsp.data.regs.x86.rsp    = dw.registers_.rsp;
-	rsp.data.regs.x86.rbp    = dw.registers_.rbp;
-	rsp.data.regs.x86.rsi    = dw.registers_.rsi;
-	rsp.data.regs.x86.rdi    = dw.registers_.rdi;
-	rsp.data.regs.x86.r8     = dw.registers_.r8;
-	rsp.data.regs.x86.r9     = dw.registers_.r9;
-	rsp.data.regs.x86.r10    = dw.registers_.r10;
-	rsp.data.regs.x86.r11    = dw.registers_.r11;
-	rsp.data.regs.x86.r12    = dw.registers_.r12;
-	rsp.data.regs.x86.r13    = dw.registers_.r13;
-	rsp.data.regs.x86.r14    = dw.registers_.r14;
-	rsp.data.regs.x86.r15    = dw.registers_.r15;
-
-	rsp.data.regs.x86.rip = dw.registers_.rip;
-
-	if ( xc_.version != Version( 4, 6 ) || xc_.isXenServer )
+	prepareSetRegisters( req, rsp );
+
+	rsp.data.regs.x86.rflags = regs.rflags;
+	rsp.data.regs.x86.rax    = regs.rax;
+	rsp.data.regs.x86.rcx    = regs.rcx;
+	rsp.data.regs.x86.rdx    = regs.rdx;
+	rsp.data.regs.x86.rbx    = regs.rbx;
+	rsp.data.regs.x86.rsp    = regs.rsp;
+	rsp.data.regs.x86.rbp    = regs.rbp;
+	rsp.data.regs.x86.rsi    = regs.rsi;
+	rsp.data.regs.x86.rdi    = regs.rdi;
+	rsp.data.regs.x86.r8     = regs.r8;
+	rsp.data.regs.x86.r9     = regs.r9;
+	rsp.data.regs.x86.r10    = regs.r10;
+	rsp.data.regs.x86.r11    = regs.r11;
+	rsp.data.regs.x86.r12    = regs.r12;
+	rsp.data.regs.x86.r13    = regs.r13;
+	rsp.data.regs.x86.r14    = regs.r14;
+	rsp.data.regs.x86.r15    = regs.r15;
+
+	rsp.data.regs.x86.rip = regs.rip;
+
+	if ( canSetRegisters_ )
 		rsp.flags |= VM_EVENT_FLAG_SET_REGISTERS;
 	else
 		logger << WARNING << "VM_EVENT_FLAG_SET_REGISTERS is not available, try a newer Xen!" << std::flush;
-
-	dw.pending_ = false;
 }
 
 void XenEventManager::waitForEvents()
 {
 	switch ( vmEventInterfaceVersion_ ) {
+	case 6:
+		return waitForEventsByVMEventVersion<vm_event_request_v6_t, vm_event_response_v6_t,
+		                                     vm_event_v6_back_ring_t>();
 	case 5:
 		return waitForEventsByVMEventVersion<vm_event_request_v5_t, vm_event_response_v5_t,
 		                                     vm_event_v5_back_ring_t>();
@@ -373,319 +719,1303 @@ void XenEventManager::waitForEvents()
 
 template <typename Request, typename Response, typename Ring> void XenEventManager::waitForEventsByVMEventVersion()
 {
-	EventHandler *h            = handler();
-	bool          shuttingDown = false;
+	EventThreadScope scope( *this, true );
 
-	for ( ;; ) {
-		waitForEventOrTimeout( 100 );
-
-		if ( sigStop_ )
-			stop();
+	bool busy = false; // the last pass found requests on the ring
 
-		if ( stop_ )
-			shuttingDown = true;
+	if ( workerCount_ && workers_.empty() )
+		startWorkers<Request, Response, Ring>();
 
+	for ( ;; ) {
 #ifndef DISABLE_MEM_EVENT
-		Request  req;
-		Response rsp;
+		// Even if spinning paid off, still look at XenStore and the event channel, just don't block
+		if ( busy && spinForRequests<Ring>() )
+			waitForEventOrTimeout( 0 );
+		else
+#endif
+		{
+			sleeps_.fetch_add( 1, std::memory_order_relaxed );
+			waitForEventOrTimeout( 100 );
+		}
 
-		int events = 0;
+		if ( !dispatchEvents<Request, Response, Ring>( busy ) )
+			return;
 
-		while ( RING_HAS_UNCONSUMED_REQUESTS( static_cast<Ring *>( backRing_ ) ) ) {
-			getRequest<Request, Ring>( req );
+		runTimers<Ring>();
+	}
+}
 
-#ifdef DEBUG_DUMP_EVENTS
-			eventsFile_.write( ( const char * )&req, sizeof( req ) );
-#endif
-			++events;
-			foundEvents_ = true;
+template <typename Request, typename Response, typename Ring> bool XenEventManager::dispatchEvents( bool &busy )
+{
+	bool shuttingDown = false;
 
-			StatsCounter counter( "eventCount" );
+	busy = false;
 
-			memset( &rsp, 0, sizeof( rsp ) );
+	runCommands();
 
-			rsp.vcpu_id       = req.vcpu_id;
-			rsp.flags         = req.flags & ~VM_EVENT_FLAG_ALTERNATE_P2M;
-			rsp.reason        = req.reason;
-			rsp.altp2m_idx    = req.altp2m_idx;
-			rsp.data.regs.x86 = req.data.regs.x86;
+	if ( sigStop_ )
+		stop();
 
-			rsp.version            = req.version;
-			rsp.u.mem_access.flags = req.u.mem_access.flags;
+	if ( stop_ )
+		shuttingDown = true;
 
-			driver_.enableCache( req.vcpu_id );
+#ifndef DISABLE_MEM_EVENT
+	int events = 0;
 
-			if ( h )
-				h->runPreEvent();
+	if ( !workers_.empty() ) {
+		std::unique_lock<std::mutex> lock( ringMutex_ );
 
-			bool skip = false;
+		while ( RING_HAS_UNCONSUMED_REQUESTS( static_cast<Ring *>( backRing_ ) ) ) {
+			const Request &req = getRequest<Request, Ring>();
+			QueuedRequest  item;
 
-			switch ( req.reason ) {
-				case VM_EVENT_REASON_MEM_ACCESS:
-					handleMemAccess( req, rsp, skip );
-					break;
+			// Copy it out now, a worker's response might land in this slot any time after unlock()
+			memcpy( item.data, &req, sizeof( req ) );
 
-				case VM_EVENT_REASON_SINGLESTEP: {
-					StatsCounter counter2( "eventsSingleStep" );
+			++events;
+			busy = true;
 
-					rsp.reason = req.reason;
-					rsp.flags |= VM_EVENT_FLAG_ALTERNATE_P2M | VM_EVENT_FLAG_TOGGLE_SINGLESTEP;
-					rsp.altp2m_idx = driver_.eptpIndex();
+			DispatchWorker &worker = *workers_[req.vcpu_id % workers_.size()];
 
-					break;
-				}
+			lock.unlock();
+			enqueueRequest( worker, item );
+			lock.lock();
+		}
 
-				case VM_EVENT_REASON_WRITE_CTRLREG:
-					handleCrWrite( req, rsp );
-					break;
+		events = 0; // the workers push their own responses
+	}
 
-				case VM_EVENT_REASON_MOV_TO_MSR:
-					handleMsrWrite( req, rsp );
-					break;
+	Response rsp{}; // only the parts selected by initResponse() / rsp.flags are ever read
 
-				case VM_EVENT_REASON_GUEST_REQUEST: {
-					StatsCounter counter2( "eventsGuestRequest" );
+	auto batchStart = std::chrono::steady_clock::now();
 
-					if ( h ) {
-						Registers regs;
-						copyRegisters( regs, req );
+	// Deferred responses get completed from other threads, so the ring is only touched under ringMutex_
+	std::unique_lock<std::mutex> lock( ringMutex_ );
 
-						h->handleVMCALL( req.vcpu_id, regs );
-					}
+	bool batch = workers_.empty() && handlerFor( BDVMI_EVENT_BATCH );
 
-					break;
-				}
+	if ( batch ) {
+		std::vector<Request> reqs;
 
-				case VM_EVENT_REASON_SOFTWARE_BREAKPOINT:
-					handleBreakpoint( req );
-					break;
+		// Copied out: a deferred response completed while the handler runs lands in the oldest
+		// unanswered slot, which may well be one of these
+		while ( RING_HAS_UNCONSUMED_REQUESTS( static_cast<Ring *>( backRing_ ) ) ) {
+			reqs.push_back( getRequest<Request, Ring>() );
 
-				case VM_EVENT_REASON_INTERRUPT:
-					if ( h ) {
-						Registers regs;
-						copyRegisters( regs, req );
+#ifdef DEBUG_DUMP_EVENTS
+			eventsFile_.write( ( const char * )&reqs.back(), sizeof( Request ) );
+#endif
+			++events;
+			busy = true;
+		}
 
-						h->handleInterrupt( req.vcpu_id, regs, req.u.interrupt.x86.vector,
-						                    req.u.interrupt.x86.error_code,
-						                    req.u.interrupt.x86.cr2 );
-					}
+		if ( !reqs.empty() ) {
+			std::vector<Response> rsps;
 
-					break;
+			lock.unlock();
+			processBatch( reqs, rsps );
+			lock.lock();
 
-				case VM_EVENT_REASON_DESCRIPTOR_ACCESS:
-					handleDescriptorWrite( req, rsp, skip );
-					break;
+			for ( auto &&batchRsp : rsps )
+				putResponse<Response, Ring>( batchRsp );
+		}
+	}
 
-				default:
-					// unknown reason code
-					break;
-			}
+	while ( !batch && workers_.empty() && RING_HAS_UNCONSUMED_REQUESTS( static_cast<Ring *>( backRing_ ) ) ) {
+		const Request &req = getRequest<Request, Ring>();
 
-			if ( driver_.pendingInjection( req.vcpu_id ) ) {
-				if ( xc_.version >= Version( 4, 9 ) || xc_.isXenServer )
-					rsp.flags |= VM_EVENT_FLAG_GET_NEXT_INTERRUPT;
-				else
-					logger << WARNING
-					       << "VM_EVENT_FLAG_GET_NEXT_INTERRUPT is not available, try a newer Xen!"
-					       << std::flush;
-				driver_.clearInjection( req.vcpu_id );
-			}
+#ifdef DEBUG_DUMP_EVENTS
+		eventsFile_.write( ( const char * )&req, sizeof( req ) );
+#endif
+		++events;
+		busy = true;
 
-			if ( !skip )
-				setRegisters( rsp );
+		// Whatever's been answered already shouldn't wait on a slow handler past its deadline
+		if ( maxBatchLatency_.count() && std::chrono::steady_clock::now() - batchStart >= maxBatchLatency_ ) {
+			pushResponses<Ring>();
+			batchStart = std::chrono::steady_clock::now();
+		}
 
-			driver_.flushPageProtections();
+		// A completion can only ever write to an older slot than this request's
+		lock.unlock();
+		bool respond = processRequest<Request, Response, Ring>( req, rsp );
+		lock.lock();
 
-			if ( h )
-				h->runPostEvent();
+		if ( !respond )
+			continue;
 
-			driver_.disableCache();
+		/* Put the page info on the ring */
+		putResponse<Response, Ring>( rsp );
 
-			/* Put the page info on the ring */
-			putResponse<Response, Ring>( rsp );
-			resumePage();
+		if ( unpushedResponses_ >= maxBatch_ ||
+		     ( maxBatchLatency_.count() &&
+		       std::chrono::steady_clock::now() - batchStart >= maxBatchLatency_ ) ) {
+			pushResponses<Ring>();
+			batchStart = std::chrono::steady_clock::now();
 		}
+	}
 
-// if ( events )
-//	resumePage();
+	if ( events )
+		pushResponses<Ring>();
+
+	lock.unlock();
 #endif // DISABLE_MEM_EVENT
 
-		if ( shuttingDown )
-			return;
+	if ( shuttingDown ) {
+		stopWorkers();
+		return false;
 	}
-}
 
-template <typename Request, typename Response>
-void XenEventManager::handleMemAccess( const Request &req, Response &rsp, bool &skip )
-{
-	uint64_t        gva             = 0;
-	const bool      read            = ( ACCESS_R( req ) != 0 );
-	const bool      write           = ( ACCESS_W( req ) != 0 );
-	const bool      execute         = ( ACCESS_X( req ) != 0 );
-	const bool      gptFault        = req.u.mem_access.flags & MEM_ACCESS_FAULT_IN_GPT;
-	HVAction        action          = NONE;
-	unsigned short  instructionSize = 0;
-	EventHandler *  h               = handler();
-	Registers       regs;
-	EmulatorContext emulatorCtx;
+	return true;
+}
 
-	StatsCounter counter( "eventsMemAccess" );
+void XenEventManager::drainEvents()
+{
+#ifndef DISABLE_MEM_EVENT
+	switch ( vmEventInterfaceVersion_ ) {
+	case 6:
+		return drainEventsByVMEventVersion<vm_event_request_v6_t, vm_event_response_v6_t,
+		                                   vm_event_v6_back_ring_t>();
+	case 5:
+		return drainEventsByVMEventVersion<vm_event_request_v5_t, vm_event_response_v5_t,
+		                                   vm_event_v5_back_ring_t>();
+	case 4:
+		return drainEventsByVMEventVersion<vm_event_request_v4_t, vm_event_response_v4_t,
+		                                   vm_event_v4_back_ring_t>();
+	default:
+		return drainEventsByVMEventVersion<vm_event_request_v3_t, vm_event_response_v3_t, vm_event_v3_back_ring_t>();
+	}
+#endif // DISABLE_MEM_EVENT
+}
 
-	rsp.flags |= VM_EVENT_FLAG_EMULATE;
-	rsp.u.mem_access.gfn = req.u.mem_access.gfn;
+template <typename Request, typename Response, typename Ring> void XenEventManager::drainEventsByVMEventVersion()
+{
+	using Clock = std::chrono::steady_clock;
 
-	if ( !h )
-		return;
+	// Long enough for a vcpu that took its exit before the events were disabled to show up on the ring
+	constexpr std::chrono::milliseconds DRAIN_QUIET{ 5 };
+	constexpr std::chrono::milliseconds DRAIN_TIMEOUT{ 2000 };
 
-	copyRegisters( regs, req );
+	EventThreadScope scope( *this, true );
 
-	if ( GLA_VALID( req ) )
-		gva = req.u.mem_access.gla;
+	Ring *                   backRing = static_cast<Ring *>( backRing_ );
+	const volatile RING_IDX &reqProd  = backRing->sring->req_prod; // written by Xen
+	RING_IDX                 lastProd = reqProd;
+	auto                     start    = Clock::now();
+	auto                     lastSeen = start;
 
-	uint64_t gpa = ( req.u.mem_access.gfn << XC::pageShift ) + req.u.mem_access.offset;
+	for ( ;; ) {
+		bool busy = false;
 
-	h->handlePageFault( req.vcpu_id, regs, gpa, gva, read, write, execute, gptFault, action,
-	                    emulatorCtx, instructionSize );
+		waitForEventOrTimeout( 1 );
 
-	switch ( action ) {
-		case EMULATE_NOWRITE:
-		case SKIP_INSTRUCTION:
-			if ( xc_.version != Version( 4, 6 ) || xc_.isXenServer ) {
-				skip                  = true;
-				rsp.data.regs.x86.rip = req.data.regs.x86.rip + instructionSize;
-				rsp.flags |= VM_EVENT_FLAG_SET_REGISTERS;
-				rsp.flags &= ~VM_EVENT_FLAG_EMULATE;
-			} else
-				rsp.flags |= VM_EVENT_FLAG_EMULATE_NOWRITE;
-			break;
+		// Answers everything pending and stops the workers. It returns false whenever stop_ is set,
+		// which it is by now, so that's no failure; failing to talk to Xen throws.
+		try {
+			dispatchEvents<Request, Response, Ring>( busy );
+		} catch ( const std::exception &e ) {
+			logger << ERROR << "[Xen events] giving up on draining: " << e.what() << std::flush;
+			return;
+		}
 
-		case ALLOW_VIRTUAL:
-			// go on, but don't emulate (monitoring application changed EIP)
-			rsp.flags &= ~VM_EVENT_FLAG_EMULATE;
-			break;
+		auto     now  = Clock::now();
+		RING_IDX prod = reqProd;
 
-		case EMULATE_SET_CTXT:
-			memcpy( rsp.data.emul.read.data, emulatorCtx.data_,
-			        std::min( ( std::size_t )emulatorCtx.size_, sizeof( rsp.data.emul.read.data ) ) );
-			rsp.data.emul.read.size = emulatorCtx.size_;
-			rsp.flags |= VM_EVENT_FLAG_SET_EMUL_READ_DATA;
-			break;
+		if ( busy || prod != lastProd || RING_HAS_UNCONSUMED_REQUESTS( backRing ) ) {
+			lastProd = prod;
+			lastSeen = now;
+		} else if ( now - lastSeen >= DRAIN_QUIET )
+			return;
 
-		case NONE:
-		default:
-			/*
-			if ( useAltP2m_ && // ( execute || gptFault ) &&
-			     req.flags & VM_EVENT_FLAG_ALTERNATE_P2M ) {
-			        rsp.flags = req.flags |
-			                    VM_EVENT_FLAG_TOGGLE_SINGLESTEP;
-			        rsp.flags &= ~VM_EVENT_FLAG_EMULATE;
-			        rsp.altp2m_idx = 0;
-			}
-			*/
-			break;
+		if ( now - start >= DRAIN_TIMEOUT ) {
+			logger << WARNING << "[Xen events] still getting events after "
+			       << std::chrono::duration_cast<std::chrono::milliseconds>( DRAIN_TIMEOUT ).count()
+			       << " ms, giving up on draining" << std::flush;
+			return;
+		}
 	}
 }
 
-template <typename Request, typename Response> void XenEventManager::handleCrWrite( const Request &req, Response &rsp )
+std::vector<int> XenEventManager::descriptors() const
 {
-	Registers      regs;
-	unsigned short crNumber = 3;
-	EventHandler * h        = handler();
-
-	StatsCounter counter( "eventsWriteCtrlReg" );
+	std::vector<int> fds{ wakeFd_, timerFd_ }; // XenStore has a thread of its own
 
-	rsp.u.write_ctrlreg.index = req.u.write_ctrlreg.index;
+#ifndef DISABLE_MEM_EVENT
+	fds.push_back( xc_.evtchnFd( xce_ ) );
+#endif
 
-	if ( !h )
-		return;
+	return fds;
+}
 
-	if ( req.u.write_ctrlreg.index == VM_EVENT_X86_XCR0 ) {
-		h->handleXSETBV( req.vcpu_id );
-		return;
+bool XenEventManager::processEvents()
+{
+	switch ( vmEventInterfaceVersion_ ) {
+	case 6:
+		return processEventsByVMEventVersion<vm_event_request_v6_t, vm_event_response_v6_t,
+		                                     vm_event_v6_back_ring_t>();
+	case 5:
+		return processEventsByVMEventVersion<vm_event_request_v5_t, vm_event_response_v5_t,
+		                                     vm_event_v5_back_ring_t>();
+	case 4:
+		return processEventsByVMEventVersion<vm_event_request_v4_t, vm_event_response_v4_t,
+		                                     vm_event_v4_back_ring_t>();
+	default:
+		return processEventsByVMEventVersion<vm_event_request_v3_t, vm_event_response_v3_t, vm_event_v3_back_ring_t>();
 	}
+}
 
-	switch ( req.u.write_ctrlreg.index ) {
-		case VM_EVENT_X86_CR0:
-			crNumber = 0;
-			break;
-		case VM_EVENT_X86_CR4:
-			crNumber = 4;
-			break;
-		case VM_EVENT_X86_CR3:
-		default:
-			crNumber = 3;
-			break;
-	}
+template <typename Request, typename Response, typename Ring> bool XenEventManager::processEventsByVMEventVersion()
+{
+	EventThreadScope scope( *this, true );
 
-	copyRegisters( regs, req );
+	bool busy = false;
 
-	HVAction action = NONE;
+	if ( workerCount_ && workers_.empty() && !stop_ )
+		startWorkers<Request, Response, Ring>();
 
-	h->handleCR( req.vcpu_id, crNumber, regs, req.u.write_ctrlreg.old_value, req.u.write_ctrlreg.new_value,
-	             action );
+	waitForEventOrTimeout( 0 );
 
-	if ( action == SKIP_INSTRUCTION || action == EMULATE_NOWRITE )
-		rsp.flags |= VM_EVENT_FLAG_DENY;
+	if ( !dispatchEvents<Request, Response, Ring>( busy ) )
+		return false;
+
+	runTimers<Ring>();
+
+	return true;
 }
 
-template <typename Request, typename Response> void XenEventManager::handleMsrWrite( const Request &req, Response &rsp )
+template <typename Ring> bool XenEventManager::spinForRequests()
 {
-	EventHandler *h = handler();
+	constexpr unsigned int MAX_PAUSES = 64;
 
-	StatsCounter counter( "eventsMovToMsr" );
+	if ( !spinBudget_.count() )
+		return false;
 
-	if ( !h )
-		return;
+	spins_.fetch_add( 1, std::memory_order_relaxed );
 
-	HVAction action = NONE;
+	auto         deadline = std::chrono::steady_clock::now() + spinBudget_;
+	unsigned int pauses   = 1;
 
-	uint64_t oldValue;
-	if ( req.version > 0x00000002 )
-		oldValue = req.u.mov_to_msr.old_value;
-	else {
-		auto i = msrOldValueCache_.find( req.vcpu_id );
-		if ( i == msrOldValueCache_.end() ) // not found
-			oldValue = getMsr( req.vcpu_id, req.u.mov_to_msr.msr );
-		else {
-			auto j = i->second.find( req.u.mov_to_msr.msr );
+	while ( !requestsPending<Ring>() ) {
+		if ( std::chrono::steady_clock::now() >= deadline )
+			return false;
 
-			if ( j == i->second.end() ) // not found
-				oldValue = getMsr( req.vcpu_id, req.u.mov_to_msr.msr );
-			else
-				oldValue = j->second;
-		}
+		// Exponential backoff, go easy on the sibling hyperthread and the memory bus
+		for ( unsigned int i = 0; i < pauses; ++i )
+			_mm_pause();
+
+		if ( pauses < MAX_PAUSES )
+			pauses <<= 1;
 	}
 
-	h->handleMSR( req.vcpu_id, req.u.mov_to_msr.msr, oldValue, req.u.mov_to_msr.new_value, action );
+	spinHits_.fetch_add( 1, std::memory_order_relaxed );
 
-	if ( action == SKIP_INSTRUCTION || action == EMULATE_NOWRITE )
-		rsp.flags |= VM_EVENT_FLAG_DENY;
-	else if ( req.version <= 0x00000002 )
-		msrOldValueCache_[req.vcpu_id][req.u.mov_to_msr.msr] = req.u.mov_to_msr.new_value;
+	return true;
 }
 
-template <typename Request, typename Response>
-void XenEventManager::handleDescriptorWrite( const Request &req, Response &rsp, bool &skip )
+template <typename Ring> bool XenEventManager::requestsPending() const
 {
-	EventHandler *h = handler();
+	const Ring *             backRing = static_cast<const Ring *>( backRing_ );
+	const volatile RING_IDX &reqProd  = backRing->sring->req_prod;
 
-	StatsCounter counter( "eventsDtr" );
+	return reqProd != backRing->req_cons; // req_cons only ever changes on the event thread
+}
 
-	if ( !h )
-		return;
+template <typename Ring> void XenEventManager::runTimers()
+{
+	std::unique_lock<std::mutex> lock( timersMutex_ );
 
-	HVAction  action = NONE;
-	Registers regs;
-	copyRegisters( regs, req );
+	if ( timerQueue_.empty() )
+		return;
 
-	unsigned int flags = 0;
+	auto now = std::chrono::steady_clock::now();
 
-	switch ( req.u.desc_access.descriptor ) {
-		case VM_EVENT_DESC_IDTR:
-			flags |= BDVMI_DESC_ACCESS_IDTR;
+	while ( !timerQueue_.empty() && timerQueue_.top().due <= now ) {
+#ifndef DISABLE_MEM_EVENT
+		// The vcpus come first, whatever is left is still due next time around
+		if ( requestsPending<Ring>() )
 			break;
-		case VM_EVENT_DESC_GDTR:
-			flags |= BDVMI_DESC_ACCESS_GDTR;
+#endif
+		TimerDue top = timerQueue_.top();
+		timerQueue_.pop();
+
+		auto i = timers_.find( top.id );
+
+		if ( i == timers_.end() || i->second.due != top.due ) // removed or rescheduled
+			continue;
+
+		// Copied and called unlocked, the callback is free to add and remove timers
+		TimerCallback callback = i->second.callback;
+		auto          deadline = now + i->second.budget;
+		bool          keep     = false;
+
+		lock.unlock();
+
+		try {
+			keep = callback( deadline );
+		} catch ( const std::exception &e ) {
+			logger << ERROR << "Timer " << top.id << ": " << e.what() << std::flush;
+		}
+
+		lock.lock();
+
+		now = std::chrono::steady_clock::now();
+		i   = timers_.find( top.id );
+
+		if ( i == timers_.end() )
+			continue;
+
+		if ( !keep ) {
+			timers_.erase( i );
+			continue;
+		}
+
+		Timer &timer = i->second;
+
+		// Don't try to catch up on missed periods
+		timer.due += timer.period;
+
+		if ( timer.due <= now )
+			timer.due = now + timer.period;
+
+		timerQueue_.push( TimerDue{ timer.due, top.id } );
+	}
+
+	armTimerFd();
+}
+
+void XenEventManager::armTimerFd()
+{
+	struct itimerspec spec = {};
+
+	// Drop the stale entries off the top, the next deadline is the first live one
+	while ( !timerQueue_.empty() ) {
+		auto i = timers_.find( timerQueue_.top().id );
+
+		if ( i != timers_.end() && i->second.due == timerQueue_.top().due )
+			break;
+
+		timerQueue_.pop();
+	}
+
+	if ( !timerQueue_.empty() ) {
+		// steady_clock is CLOCK_MONOTONIC
+		auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>( timerQueue_.top().due.time_since_epoch() )
+		                  .count();
+
+		spec.it_value.tv_sec  = ns / 1000000000;
+		spec.it_value.tv_nsec = ns % 1000000000;
+
+		// All zeroes would disarm it
+		if ( !spec.it_value.tv_sec && !spec.it_value.tv_nsec )
+			spec.it_value.tv_nsec = 1;
+	}
+
+	if ( timerfd_settime( timerFd_, TFD_TIMER_ABSTIME, &spec, nullptr ) < 0 )
+		logger << ERROR << "[Xen events] could not arm the timerfd: " << strerror( errno ) << std::flush;
+}
+
+unsigned int XenEventManager::addTimer( std::chrono::milliseconds period, std::chrono::microseconds budget,
+                                        TimerCallback callback )
+{
+	if ( period.count() <= 0 || !callback )
+		return 0;
+
+	unsigned int id = ++lastTimerId_;
+
+	// Any thread, dispatch workers included, so this takes the lock rather than going through the event thread
+	std::lock_guard<std::mutex> guard( timersMutex_ );
+
+	Timer &timer = timers_[id];
+
+	timer.due      = std::chrono::steady_clock::now() + period;
+	timer.period   = period;
+	timer.budget   = budget;
+	timer.callback = std::move( callback );
+
+	timerQueue_.push( TimerDue{ timer.due, id } );
+	armTimerFd(); // the loop's poll() picks up the new deadline
+
+	return id;
+}
+
+bool XenEventManager::removeTimer( unsigned int id )
+{
+	std::lock_guard<std::mutex> guard( timersMutex_ );
+
+	// The heap entry goes stale, armTimerFd() / runTimers() will drop it
+	if ( !timers_.erase( id ) )
+		return false;
+
+	armTimerFd();
+	return true;
+}
+
+bool XenEventManager::setBusyPoll( unsigned int spinUs )
+{
+	// Read by the event loop only
+	return runOnEventThread( [this, spinUs]() {
+		spinBudget_ = std::chrono::microseconds( spinUs );
+		return true;
+	} );
+}
+
+EventManager::BusyPollStats XenEventManager::busyPollStats() const
+{
+	BusyPollStats stats;
+
+	stats.spins    = spins_.load( std::memory_order_relaxed );
+	stats.spinHits = spinHits_.load( std::memory_order_relaxed );
+	stats.sleeps   = sleeps_.load( std::memory_order_relaxed );
+
+	return stats;
+}
+
+bool XenEventManager::setParallelDispatch( unsigned int workers )
+{
+	// Can't change this while the workers of a running waitForEvents() are around
+	if ( !workers_.empty() )
+		return false;
+
+	workerCount_ = workers > 1 ? workers : 0;
+
+	return true;
+}
+
+template <typename Request, typename Response, typename Ring> void XenEventManager::startWorkers()
+{
+	static_assert( sizeof( Request ) <= sizeof( QueuedRequest ), "QueuedRequest is too small" );
+
+	for ( unsigned int i = 0; i < workerCount_; ++i ) {
+		workers_.emplace_back( new DispatchWorker );
+
+		DispatchWorker &worker = *workers_.back();
+
+		worker.thread_ = std::thread( [this, &worker]() { runWorker<Request, Response, Ring>( worker ); } );
+	}
+
+	logger << INFO << "Dispatching events on " << workerCount_ << " threads" << std::flush;
+}
+
+void XenEventManager::stopWorkers()
+{
+	for ( auto &&worker : workers_ ) {
+		std::lock_guard<std::mutex> lock( worker->mutex_ );
+
+		worker->stop_ = true;
+		worker->cv_.notify_one();
+	}
+
+	// Each worker still empties its queue before leaving. Their handlers may be waiting on commands
+	// they've posted, so when this is the event thread it keeps running those in the meantime.
+	if ( eventThreadOwner == this )
+		waitServingCommands( [this]() {
+			for ( auto &&worker : workers_ )
+				if ( !worker->exited_ )
+					return false;
+			return true;
+		} );
+
+	for ( auto &&worker : workers_ )
+		if ( worker->thread_.joinable() )
+			worker->thread_.join();
+
+	workers_.clear();
+}
+
+void XenEventManager::enqueueRequest( DispatchWorker &worker, const QueuedRequest &item )
+{
+	// Can only happen if a single worker has more requests queued than the ring can hold. Its
+	// handler may be waiting on a command, so keep running those until it makes room.
+	if ( !worker.queue_.push( item ) ) {
+		worker.full_ = true;
+
+		// Pairs with the fence in runWorker(): either it sees full_, or our next push() succeeds
+		std::atomic_thread_fence( std::memory_order_seq_cst );
+
+		waitServingCommands( [&worker, &item]() { return worker.queue_.push( item ); } );
+
+		worker.full_ = false;
+	}
+
+	// Pairs with the fence in runWorker(): either we see it sleeping, or it sees the new item
+	std::atomic_thread_fence( std::memory_order_seq_cst );
+
+	if ( worker.sleeping_.load( std::memory_order_relaxed ) ) {
+		std::lock_guard<std::mutex> lock( worker.mutex_ );
+		worker.cv_.notify_one();
+	}
+}
+
+template <typename Request, typename Response, typename Ring>
+void XenEventManager::runWorker( DispatchWorker &worker )
+{
+	QueuedRequest item;
+	Request       req;
+	Response      rsp{};
+
+	for ( ;; ) {
+		if ( !worker.queue_.pop( item ) ) {
+			if ( worker.stop_ ) {
+				if ( worker.queue_.empty() ) {
+					worker.exited_ = true;
+
+					std::lock_guard<std::mutex> guard( serveMutex_ );
+					serveCv_.notify_all();
+					return;
+				}
+
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lock( worker.mutex_ );
+
+			worker.sleeping_ = true;
+			std::atomic_thread_fence( std::memory_order_seq_cst );
+
+			worker.cv_.wait( lock, [&worker]() { return !worker.queue_.empty() || worker.stop_; } );
+
+			worker.sleeping_ = false;
+			continue;
+		}
+
+		memcpy( &req, item.data, sizeof( req ) );
+
+		// Pairs with the fence in enqueueRequest(): there's room now, wake the event thread if it's waiting
+		std::atomic_thread_fence( std::memory_order_seq_cst );
+
+		if ( worker.full_.load( std::memory_order_relaxed ) ) {
+			std::lock_guard<std::mutex> guard( serveMutex_ );
+			serveCv_.notify_all();
+		}
+
+		try {
+			if ( !processRequest<Request, Response, Ring>( req, rsp ) )
+				continue;
+
+			std::lock_guard<std::mutex> guard( ringMutex_ );
+
+			putResponse<Response, Ring>( rsp );
+			pushResponses<Ring>();
+		} catch ( const std::exception &e ) {
+			logger << ERROR << "[vcpu " << req.vcpu_id << "] " << e.what() << std::flush;
+		}
+	}
+}
+
+template <typename Request, typename Response, typename Ring>
+bool XenEventManager::processRequest( const Request &req, Response &rsp )
+{
+	EventHandler *h = handlerFor( BDVMI_EVENT_PRE_POST );
+
+	StatsCounter counter( "eventCount" );
+
+	initResponse( req, rsp );
+
+	if ( !( req.flags & VM_EVENT_FLAG_VCPU_PAUSED ) ) {
+		// Nobody's waiting: the bare response only frees up the slot
+		notifyAsync<Request, Response>( req );
+		return true;
+	}
+
+	if ( req.reason == VM_EVENT_REASON_MOV_TO_MSR && asyncEvents( BDVMI_EVENT_MSR ) ) {
+		// Xen always pauses the vcpu on MSR writes, so let it go before looking at the event.
+		// The response overwrites the request's slot, hence the copy.
+		Request copy = req;
+
+		{
+			std::lock_guard<std::mutex> guard( ringMutex_ );
+
+			putResponse<Response, Ring>( rsp );
+			pushResponses<Ring>();
+		}
+
+		notifyAsync<Request, Response>( copy );
+		return false;
+	}
+
+	driver_.enableCache( req.vcpu_id );
+
+	currentEvent.manager    = this;
+	currentEvent.vcpu       = req.vcpu_id;
+	currentEvent.inCallback = true;
+	currentEvent.token      = 0;
+
+	if ( h )
+		h->runPreEvent();
+
+	XenRegisterView<Request> regs( req );
+	Event                    event;
+	EventHandler *           eventHandler = prepareEvent( req, rsp, regs, event );
+	bool                     skip         = false;
+
+	trackPageFault( req, event );
+
+	if ( eventHandler ) {
+		if ( !filterEvent( event ) )
+			eventHandler->handleEvent( event );
+
+		concludeEvent( req, rsp, event, skip );
+	}
+
+	currentEvent.inCallback = false;
+
+	bool respond = !currentEvent.token || !parkResponse( currentEvent.token, req, rsp, skip );
+
+	if ( respond )
+		finishResponse( req, rsp, skip );
+
+	driver_.flushPageProtections();
+
+	if ( h )
+		h->runPostEvent();
+
+	driver_.disableCache( req.vcpu_id );
+
+	return respond;
+}
+
+template <typename Request, typename Response> void XenEventManager::notifyAsync( const Request &req )
+{
+	EventHandler *h = handlerFor( BDVMI_EVENT_PRE_POST );
+
+	// The vcpu may well be running: no register cache, and nothing to defer
+	currentEvent.manager    = this;
+	currentEvent.vcpu       = req.vcpu_id;
+	currentEvent.inCallback = false;
+	currentEvent.token      = 0;
+
+	if ( h )
+		h->runPreEvent();
+
+	XenRegisterView<Request> regs( req );
+	Response                 scratch;
+	Event                    event;
+
+	initResponse( req, scratch );
+
+	EventHandler *eventHandler = prepareEvent( req, scratch, regs, event );
+
+	if ( eventHandler && !filterEvent( event ) )
+		eventHandler->handleEvent( event );
+
+	driver_.flushPageProtections();
+
+	if ( h )
+		h->runPostEvent();
+}
+
+template <typename Request, typename Response>
+void XenEventManager::processBatch( const std::vector<Request> &reqs, std::vector<Response> &rsps )
+{
+	EventHandler *h     = handlerFor( BDVMI_EVENT_BATCH );
+	size_t        count = reqs.size();
+
+	StatsCounter counter( "eventBatch" );
+
+	std::vector<XenRegisterView<Request>> regs;
+	std::vector<Event>                    events;
+	std::vector<size_t>                   owners; // events[i] came from reqs[owners[i]]
+	std::vector<char>                     skips( count, 0 );
+
+	regs.reserve( count ); // the events point into it
+	events.reserve( count );
+	owners.reserve( count );
+	rsps.resize( count );
+
+	currentEvent.manager    = this;
+	currentEvent.inCallback = false;
+	currentEvent.token      = 0;
+
+	for ( size_t i = 0; i < count; ++i ) {
+		initResponse( reqs[i], rsps[i] );
+		driver_.enableCache( reqs[i].vcpu_id );
+
+		regs.emplace_back( reqs[i] );
+		events.emplace_back();
+
+		Event &event = events.back();
+
+		bool wanted = prepareEvent( reqs[i], rsps[i], regs.back(), event );
+
+		trackPageFault( reqs[i], event );
+
+		if ( !wanted ) {
+			events.pop_back();
+			continue;
+		}
+
+		// Filtered events are done with right here, the handler doesn't get to see them
+		if ( filterEvent( event ) ) {
+			bool skip = false;
+
+			if ( reqs[i].flags & VM_EVENT_FLAG_VCPU_PAUSED )
+				concludeEvent( reqs[i], rsps[i], event, skip );
+			skips[i] = skip;
+			events.pop_back();
+			continue;
+		}
+
+		owners.push_back( i );
+	}
+
+	if ( handlerFor( BDVMI_EVENT_PRE_POST ) )
+		h->runPreEvent();
+
+	if ( !events.empty() )
+		h->handleEvents( events.data(), events.size() );
+
+	for ( size_t i = 0, j = 0; i < count; ++i ) {
+		bool skip   = skips[i];
+		bool paused = reqs[i].flags & VM_EVENT_FLAG_VCPU_PAUSED;
+
+		if ( j < owners.size() && owners[j] == i ) {
+			Event &event = events[j++];
+
+			if ( paused )
+				concludeEvent( reqs[i], rsps[i], event, skip );
+		}
+
+		// Asynchronous events keep the bare response, the vcpu didn't wait for it
+		if ( paused )
+			finishResponse( reqs[i], rsps[i], skip );
+	}
+
+	driver_.flushPageProtections();
+
+	if ( handlerFor( BDVMI_EVENT_PRE_POST ) )
+		h->runPostEvent();
+
+	for ( auto &&req : reqs )
+		driver_.disableCache( req.vcpu_id );
+}
+
+template <typename Request, typename Response>
+void XenEventManager::finishResponse( const Request &req, Response &rsp, bool skip )
+{
+	if ( driver_.pendingInjection( req.vcpu_id ) ) {
+		if ( canGetNextInterrupt_ )
+			rsp.flags |= VM_EVENT_FLAG_GET_NEXT_INTERRUPT;
+		else
+			logger << WARNING
+			       << "VM_EVENT_FLAG_GET_NEXT_INTERRUPT is not available, try a newer Xen!"
+			       << std::flush;
+		driver_.clearInjection( req.vcpu_id );
+	}
+
+	if ( !skip )
+		setRegisters( req, rsp );
+}
+
+template <typename Request, typename Response>
+void XenEventManager::applyAction( const Request &req, Response &rsp, HVAction action,
+                                   const EmulatorContext &emulatorCtx, unsigned short instructionSize, bool &skip )
+{
+	switch ( req.reason ) {
+		case VM_EVENT_REASON_MEM_ACCESS:
+			switch ( action ) {
+				case EMULATE_NOWRITE:
+				case SKIP_INSTRUCTION:
+					if ( canSetRegisters_ ) {
+						skip = true;
+						prepareSetRegisters( req, rsp );
+						rsp.data.regs.x86.rip = req.data.regs.x86.rip + instructionSize;
+						rsp.flags |= VM_EVENT_FLAG_SET_REGISTERS;
+						rsp.flags &= ~VM_EVENT_FLAG_EMULATE;
+					} else
+						rsp.flags |= VM_EVENT_FLAG_EMULATE_NOWRITE;
+					break;
+
+				case ALLOW_VIRTUAL:
+					// go on, but don't emulate (monitoring application changed EIP)
+					rsp.flags &= ~VM_EVENT_FLAG_EMULATE;
+					break;
+
+				case EMULATE_SET_CTXT:
+					memcpy( rsp.data.emul.read.data, emulatorCtx.data_,
+					        std::min( ( std::size_t )emulatorCtx.size_,
+					                  sizeof( rsp.data.emul.read.data ) ) );
+					rsp.data.emul.read.size = emulatorCtx.size_;
+					rsp.flags |= VM_EVENT_FLAG_SET_EMUL_READ_DATA;
+					break;
+
+				case ALLOW_SINGLESTEP: {
+					unsigned short view = 0;
+
+					if ( !singlestepView( view ) ) // emulate it, as for NONE
+						break;
+
+					// After the step the vcpu goes back to the view it faulted in
+					uint16_t back = ( req.flags & VM_EVENT_FLAG_ALTERNATE_P2M ) ? req.altp2m_idx : 0;
+
+					rsp.flags &= ~VM_EVENT_FLAG_EMULATE;
+					rsp.flags |= VM_EVENT_FLAG_ALTERNATE_P2M | VM_EVENT_FLAG_TOGGLE_SINGLESTEP;
+					rsp.altp2m_idx = view;
+
+					if ( !canFastSinglestep_ || !setFastSinglestep( rsp, back ) ) {
+						// The SINGLESTEP event does the switch back
+						std::lock_guard<std::mutex> guard( singlestepMutex_ );
+						singlestepReturnView_[req.vcpu_id] = back;
+					}
+					break;
+				}
+
+				case NONE:
+				default:
+					// Plain emulation: hand over the instruction bytes, if we have them, so
+					// Xen doesn't have to fetch them again from guest memory
+					if ( emulatorCtx.insnSize_ && canSetEmulInsnData_ &&
+					     ( rsp.flags & VM_EVENT_FLAG_EMULATE ) ) {
+						size_t size = std::min( ( std::size_t )emulatorCtx.insnSize_,
+						                        sizeof( rsp.data.emul.insn.data ) );
+
+						memset( rsp.data.emul.insn.data, 0, sizeof( rsp.data.emul.insn.data ) );
+						memcpy( rsp.data.emul.insn.data, emulatorCtx.insn_, size );
+						rsp.flags |= VM_EVENT_FLAG_SET_EMUL_INSN_DATA;
+					}
+					break;
+			}
+			break;
+
+		case VM_EVENT_REASON_WRITE_CTRLREG:
+			if ( action == SKIP_INSTRUCTION || action == EMULATE_NOWRITE )
+				rsp.flags |= VM_EVENT_FLAG_DENY;
+			break;
+
+		case VM_EVENT_REASON_MOV_TO_MSR:
+			if ( action == SKIP_INSTRUCTION || action == EMULATE_NOWRITE )
+				rsp.flags |= VM_EVENT_FLAG_DENY;
+			else if ( req.version <= 0x00000002 ) {
+				std::lock_guard<std::mutex> guard( msrOldValueCacheMutex_ );
+				msrOldValueCache_[req.vcpu_id][req.u.mov_to_msr.msr] = req.u.mov_to_msr.new_value;
+			}
+			break;
+
+		case VM_EVENT_REASON_DESCRIPTOR_ACCESS:
+			if ( action == SKIP_INSTRUCTION || action == EMULATE_NOWRITE ) {
+				if ( canSetRegisters_ ) {
+					skip = true;
+					prepareSetRegisters( req, rsp );
+					rsp.data.regs.x86.rip = req.data.regs.x86.rip + instructionSize;
+					rsp.flags |= VM_EVENT_FLAG_SET_REGISTERS;
+				} else
+					logger << ERROR << "No instruction skip support!" << std::flush;
+			} else if ( action != ALLOW_VIRTUAL ) // Do _nothing_ on ALLOW_VIRTUAL
+				rsp.flags |= VM_EVENT_FLAG_EMULATE;
+			break;
+
+		default:
+			// nothing to decide for the other events
+			break;
+	}
+}
+
+bool XenEventManager::singlestepView( unsigned short &view )
+{
+	std::call_once( singlestepOnce_, [this]() {
+		unsigned short index = 0;
+
+		// A fresh view, which nothing ever restricts
+		if ( !driver_.createEPT( index ) ) {
+			logger << WARNING << "ALLOW_SINGLESTEP needs altp2m, emulating instead" << std::flush;
+			return;
+		}
+
+		if ( !canFastSinglestep_ && xc_.monitorSinglestep( domain_, 1 ) < 0 ) {
+			logger << WARNING << "[Xen events] could not enable singlestep monitoring, emulating instead"
+			       << std::flush;
+			driver_.destroyEPT( index );
+			return;
+		}
+
+		singlestepView_  = index;
+		singlestepReady_ = true;
+	} );
+
+	view = singlestepView_;
+	return singlestepReady_;
+}
+
+void XenEventManager::releaseSinglestepView()
+{
+	if ( !singlestepReady_ )
+		return;
+
+	if ( !canFastSinglestep_ )
+		xc_.monitorSinglestep( domain_, 0 );
+
+	driver_.destroyEPT( singlestepView_ );
+	singlestepReady_ = false;
+}
+
+bool XenEventManager::deferResponse( unsigned short vcpu, ResponseToken &token )
+{
+	if ( currentEvent.manager != this || !currentEvent.inCallback || currentEvent.vcpu != vcpu ) {
+		logger << ERROR << "deferResponse() called outside of a callback for vcpu " << vcpu << std::flush;
+		return false;
+	}
+
+	// Asking twice gets the same token
+	if ( currentEvent.token ) {
+		token = currentEvent.token;
+		return true;
+	}
+
+	std::lock_guard<std::mutex> lock( parkedMutex_ );
+
+	token = ++lastToken_;
+	parked_[token].reset( new ParkedResponse );
+
+	currentEvent.token = token;
+
+	return true;
+}
+
+template <typename Request, typename Response>
+bool XenEventManager::parkResponse( ResponseToken token, const Request &req, Response &rsp, bool &skip )
+{
+	static_assert( sizeof( Request ) <= sizeof( QueuedRequest ) && sizeof( Response ) <= sizeof( QueuedRequest ),
+	               "QueuedRequest is too small" );
+
+	std::unique_lock<std::mutex> lock( parkedMutex_ );
+
+	auto i = parked_.find( token );
+
+	if ( i == parked_.end() )
+		return false;
+
+	ParkedResponse &parked = *i->second;
+
+	if ( parked.state == ParkedResponse::COMPLETED ) {
+		// completeResponse() won the race with the callback returning, just respond now
+		std::unique_ptr<ParkedResponse> done = std::move( i->second );
+		parked_.erase( i );
+		lock.unlock();
+
+		applyAction( req, rsp, done->action, done->emulatorCtx, done->instructionSize, skip );
+		return false;
+	}
+
+	memcpy( parked.request.data, &req, sizeof( req ) );
+	memcpy( parked.response.data, &rsp, sizeof( rsp ) );
+	parked.skip  = skip;
+	parked.state = ParkedResponse::PARKED;
+
+	return true;
+}
+
+bool XenEventManager::completeResponse( ResponseToken token, HVAction action, const EmulatorContext *emulatorCtx,
+                                        unsigned short instructionSize )
+{
+	std::unique_ptr<ParkedResponse> parked;
+
+	{
+		std::lock_guard<std::mutex> lock( parkedMutex_ );
+
+		auto i = parked_.find( token );
+
+		if ( i == parked_.end() || i->second->state == ParkedResponse::COMPLETED ) {
+			logger << ERROR << "Unknown or already completed response token " << token << std::flush;
+			return false;
+		}
+
+		ParkedResponse &entry = *i->second;
+
+		entry.action          = action;
+		entry.instructionSize = instructionSize;
+
+		if ( emulatorCtx )
+			entry.emulatorCtx = *emulatorCtx;
+
+		// The callback that deferred it hasn't even returned yet, it'll respond itself
+		if ( entry.state == ParkedResponse::REQUESTED ) {
+			entry.state = ParkedResponse::COMPLETED;
+			return true;
+		}
+
+		parked = std::move( i->second );
+		parked_.erase( i );
+	}
+
+	try {
+		switch ( vmEventInterfaceVersion_ ) {
+			case 6:
+				completeParked<vm_event_request_v6_t, vm_event_response_v6_t, vm_event_v6_back_ring_t>(
+				        *parked );
+				break;
+			case 5:
+				completeParked<vm_event_request_v5_t, vm_event_response_v5_t, vm_event_v5_back_ring_t>(
+				        *parked );
+				break;
+			case 4:
+				completeParked<vm_event_request_v4_t, vm_event_response_v4_t, vm_event_v4_back_ring_t>(
+				        *parked );
+				break;
+			default:
+				completeParked<vm_event_request_v3_t, vm_event_response_v3_t, vm_event_v3_back_ring_t>(
+				        *parked );
+				break;
+		}
+	} catch ( const std::exception &e ) {
+		logger << ERROR << "Could not complete response " << token << ": " << e.what() << std::flush;
+		return false;
+	}
+
+	return true;
+}
+
+template <typename Request, typename Response, typename Ring>
+void XenEventManager::completeParked( const ParkedResponse &parked )
+{
+	Request  req;
+	Response rsp;
+	bool     skip = parked.skip;
+
+	memcpy( &req, parked.request.data, sizeof( req ) );
+	memcpy( &rsp, parked.response.data, sizeof( rsp ) );
+
+	applyAction( req, rsp, parked.action, parked.emulatorCtx, parked.instructionSize, skip );
+	finishResponse( req, rsp, skip );
+
+	driver_.flushPageProtections();
+
+	std::lock_guard<std::mutex> guard( ringMutex_ );
+
+	putResponse<Response, Ring>( rsp );
+	pushResponses<Ring>();
+}
+
+void XenEventManager::releaseParkedResponses()
+{
+	std::vector<ResponseToken> tokens;
+
+	{
+		std::lock_guard<std::mutex> lock( parkedMutex_ );
+
+		for ( auto &&item : parked_ )
+			if ( item.second->state == ParkedResponse::PARKED )
+				tokens.push_back( item.first );
+	}
+
+	if ( !tokens.empty() )
+		logger << WARNING << "Releasing " << tokens.size() << " deferred response(s)" << std::flush;
+
+	for ( auto &&token : tokens )
+		completeResponse( token, NONE );
+}
+
+template <typename Request, typename Response>
+EventHandler *XenEventManager::prepareEvent( const Request &req, Response &rsp, const RegisterView &regs,
+                                             Event &event )
+{
+	event.vcpu = req.vcpu_id;
+	event.regs = &regs;
+
+	switch ( req.reason ) {
+		case VM_EVENT_REASON_MEM_ACCESS:
+			prepareMemAccess( req, event );
+			break;
+
+		case VM_EVENT_REASON_SINGLESTEP: {
+			StatsCounter counter( "eventsSingleStep" );
+
+			// The flags come from the response template
+			rsp.altp2m_idx = driver_.eptpIndex();
+
+			std::lock_guard<std::mutex> guard( singlestepMutex_ );
+
+			auto it = singlestepReturnView_.find( req.vcpu_id );
+
+			if ( it != singlestepReturnView_.end() ) {
+				rsp.altp2m_idx = it->second;
+				singlestepReturnView_.erase( it );
+			}
+
+			return nullptr;
+		}
+
+		case VM_EVENT_REASON_WRITE_CTRLREG:
+			prepareCrWrite( req, event );
+			break;
+
+		case VM_EVENT_REASON_MOV_TO_MSR:
+			event.type = BDVMI_EVENT_MSR;
+			break;
+
+		case VM_EVENT_REASON_GUEST_REQUEST:
+			event.type = BDVMI_EVENT_VMCALL;
+			break;
+
+		case VM_EVENT_REASON_SOFTWARE_BREAKPOINT:
+			event.type        = BDVMI_EVENT_BREAKPOINT;
+			event.physAddress = gfn_to_gpa( req.u.software_breakpoint.gfn );
+			break;
+
+		case VM_EVENT_REASON_INTERRUPT:
+			event.type      = BDVMI_EVENT_INTERRUPT;
+			event.vector    = req.u.interrupt.x86.vector;
+			event.errorCode = req.u.interrupt.x86.error_code;
+			event.cr2       = req.u.interrupt.x86.cr2;
+			break;
+
+		case VM_EVENT_REASON_DESCRIPTOR_ACCESS:
+			prepareDescriptorAccess( req, event );
+			break;
+
+		default:
+			// unknown reason code
+			return nullptr;
+	}
+
+	EventHandler *h = handlerFor( event.type );
+
+	// Only worth looking up the old value if somebody's going to see it
+	if ( h && event.type == BDVMI_EVENT_MSR )
+		prepareMsrWrite( req, event );
+
+	return h;
+}
+
+template <typename Request, typename Response>
+void XenEventManager::concludeEvent( const Request &req, Response &rsp, Event &event, bool &skip )
+{
+	switch ( event.type ) {
+		case BDVMI_EVENT_BREAKPOINT:
+			if ( event.reinject )
+				reinjectBreakpoint( req );
+			return;
+
+		default:
+			break;
+	}
+
+	if ( currentEvent.token ) // deferred, completeResponse() will decide
+		return;
+
+	applyAction( req, rsp, event.action, event.emulatorCtx, event.instructionSize, skip );
+}
+
+template <typename Request> void XenEventManager::prepareMemAccess( const Request &req, Event &event )
+{
+	StatsCounter counter( "eventsMemAccess" );
+
+	event.type        = BDVMI_EVENT_PAGE_FAULT;
+	event.physAddress = ( req.u.mem_access.gfn << XC::pageShift ) + req.u.mem_access.offset;
+	event.virtAddress = GLA_VALID( req ) ? req.u.mem_access.gla : 0;
+	event.read        = ( ACCESS_R( req ) != 0 );
+	event.write       = ( ACCESS_W( req ) != 0 );
+	event.execute     = ( ACCESS_X( req ) != 0 );
+	event.inGpt       = req.u.mem_access.flags & MEM_ACCESS_FAULT_IN_GPT;
+}
+
+template <typename Request> void XenEventManager::trackPageFault( const Request &req, const Event &event )
+{
+	if ( req.reason != VM_EVENT_REASON_MEM_ACCESS )
+		return;
+
+	unsigned short view = ( req.flags & VM_EVENT_FLAG_ALTERNATE_P2M ) ? req.altp2m_idx : 0;
+	uint64_t       rate = 0;
+
+	if ( !trackHotPage( view, req.u.mem_access.gfn, rate ) )
+		return;
+
+	EventHandler *hotPageHandler = handlerFor( BDVMI_EVENT_HOT_PAGE );
+	bool          relax          = hotPageAutoRelax();
+
+	if ( hotPageHandler )
+		hotPageHandler->handleHotPage( req.vcpu_id, event.physAddress, view, rate, relax );
+
+	if ( relax )
+		relaxHotPage( event.physAddress, view, event.read, event.write, event.execute );
+}
+
+void XenEventManager::relaxHotPage( uint64_t gpa, unsigned short view, bool read, bool write, bool execute )
+{
+	bool r = false, w = false, x = false;
+
+	if ( !driver_.getPageProtection( gpa, r, w, x, view ) )
+		return;
+
+	r = r || read || write; // write-only is an EPT misconfiguration
+	w = w || write;
+	x = x || execute;
+
+	// Flushed together with everything else once the event has been handled
+	if ( driver_.setPageProtection( gpa, r, w, x, view ) ) {
+		markHotPageRelaxed( view, gpa_to_gfn( gpa ) );
+
+		logger << WARNING << "Relaxed hot page " << std::hex << std::showbase << gpa << " (view " << std::dec
+		       << view << ") to " << ( r ? "r" : "-" ) << ( w ? "w" : "-" ) << ( x ? "x" : "-" ) << std::flush;
+	}
+}
+
+template <typename Request> void XenEventManager::prepareCrWrite( const Request &req, Event &event )
+{
+	StatsCounter counter( "eventsWriteCtrlReg" );
+
+	if ( req.u.write_ctrlreg.index == VM_EVENT_X86_XCR0 ) {
+		event.type = BDVMI_EVENT_XSETBV;
+		return;
+	}
+
+	switch ( req.u.write_ctrlreg.index ) {
+		case VM_EVENT_X86_CR0:
+			event.crNumber = 0;
+			break;
+		case VM_EVENT_X86_CR4:
+			event.crNumber = 4;
+			break;
+		case VM_EVENT_X86_CR3:
+		default:
+			event.crNumber = 3;
+			break;
+	}
+
+	event.type     = BDVMI_EVENT_CR;
+	event.oldValue = req.u.write_ctrlreg.old_value;
+	event.newValue = req.u.write_ctrlreg.new_value;
+}
+
+template <typename Request> void XenEventManager::prepareMsrWrite( const Request &req, Event &event )
+{
+	StatsCounter counter( "eventsMovToMsr" );
+
+	event.msr      = req.u.mov_to_msr.msr;
+	event.newValue = req.u.mov_to_msr.new_value;
+
+	if ( req.version > 0x00000002 ) {
+		event.oldValue = req.u.mov_to_msr.old_value;
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard( msrOldValueCacheMutex_ );
+
+		auto i = msrOldValueCache_.find( req.vcpu_id );
+		if ( i != msrOldValueCache_.end() ) {
+			auto j = i->second.find( req.u.mov_to_msr.msr );
+
+			if ( j != i->second.end() ) {
+				event.oldValue = j->second;
+				return;
+			}
+		}
+	}
+
+	event.oldValue = getMsr( req.vcpu_id, req.u.mov_to_msr.msr );
+}
+
+template <typename Request> void XenEventManager::prepareDescriptorAccess( const Request &req, Event &event )
+{
+	StatsCounter counter( "eventsDtr" );
+
+	unsigned int flags = 0;
+
+	switch ( req.u.desc_access.descriptor ) {
+		case VM_EVENT_DESC_IDTR:
+			flags |= BDVMI_DESC_ACCESS_IDTR;
+			break;
+		case VM_EVENT_DESC_GDTR:
+			flags |= BDVMI_DESC_ACCESS_GDTR;
 			break;
 		case VM_EVENT_DESC_LDTR:
 			flags |= BDVMI_DESC_ACCESS_LDTR;
@@ -697,43 +2027,36 @@ void XenEventManager::handleDescriptorWrite( const Request &req, Response &rsp,
 
 	flags |= ( req.u.desc_access.is_write ? BDVMI_DESC_ACCESS_WRITE : BDVMI_DESC_ACCESS_READ );
 
-	unsigned short instructionSize = 0;
-
-	h->handleDescriptorAccess( req.vcpu_id, regs, flags, instructionSize, action );
-
-	if ( action == SKIP_INSTRUCTION || action == EMULATE_NOWRITE ) {
-		if ( xc_.version != Version( 4, 6 ) || xc_.isXenServer ) {
-			skip                  = true;
-			rsp.data.regs.x86.rip = req.data.regs.x86.rip + instructionSize;
-			rsp.flags |= VM_EVENT_FLAG_SET_REGISTERS;
-		} else
-			logger << ERROR << "No instruction skip support!" << std::flush;
-	} else if ( action != ALLOW_VIRTUAL ) // Do _nothing_ on ALLOW_VIRTUAL
-		rsp.flags |= VM_EVENT_FLAG_EMULATE;
+	event.type            = BDVMI_EVENT_DESCRIPTOR;
+	event.descriptorFlags = flags;
 }
 
-template <typename Request> void XenEventManager::handleBreakpoint( const Request &req )
+template <typename Request> void XenEventManager::reinjectBreakpoint( const Request &req )
 {
-	EventHandler *h        = handler();
-	bool          reinject = ( h != nullptr );
-	uint32_t      insn_len = ( req.version < 0x00000002 ? 1 : req.u.software_breakpoint.insn_length );
-	uint8_t type = ( req.version < 0x00000002 ? HVMOP_TRAP_sw_exc : req.u.software_breakpoint.type );
+	uint32_t insn_len = ( req.version < 0x00000002 ? 1 : req.u.software_breakpoint.insn_length );
+	uint8_t  type     = ( req.version < 0x00000002 ? HVMOP_TRAP_sw_exc : req.u.software_breakpoint.type );
 
 	StatsCounter counter( "eventsBreakPoint" );
 
-	if ( h ) {
-		Registers regs;
-		copyRegisters( regs, req );
-
-		reinject = !h->handleBreakpoint( req.vcpu_id, regs, gfn_to_gpa( req.u.software_breakpoint.gfn ) );
-	}
-
-	if ( reinject && xc_.hvmInjectTrap( domain_, req.vcpu_id, X86_TRAP_INT3, type, ~0u, insn_len, 0 ) < 0 )
+	if ( xc_.hvmInjectTrap( domain_, req.vcpu_id, X86_TRAP_INT3, type, ~0u, insn_len, 0 ) < 0 )
 		logger << ERROR << "Could not reinject breakpoint" << std::flush;
 }
 
 void XenEventManager::stop()
 {
+	// The handler and the monitor settings belong to the event thread, let it do the work
+	// (postCommand() runs it right away if there's no loop). Dispatch workers post it too.
+	if ( eventThreadOwner != this ) {
+		postCommand( [this]() {
+			try {
+				stop();
+			} catch ( const std::exception &e ) {
+				logger << ERROR << e.what() << std::flush;
+			}
+		} );
+		return;
+	}
+
 	if ( stop_ ) // It's already been called
 		return;
 
@@ -799,11 +2122,16 @@ void XenEventManager::initEventChannels()
 
 	vmEventInterfaceVersion_ = xc_.vmEventGetVersion();
 
+	initResponseTemplates();
+
 	logger << DEBUG << "VM_EVENT_INTERFACE_VERSION: 0x" << std::hex << std::setfill( '0' ) << std::setw( 8 )
 	       << vmEventInterfaceVersion_ << std::flush;
 
 #define private rprivate
 	switch ( vmEventInterfaceVersion_ ) {
+	case 6:
+		INIT_EVENT_CHANNEL( 6 );
+		break;
 	case 5:
 		INIT_EVENT_CHANNEL( 5 );
 		break;
@@ -849,21 +2177,31 @@ void XenEventManager::initMemAccess()
 int XenEventManager::waitForEventOrTimeout( int ms )
 {
 #ifndef DISABLE_MEM_EVENT
-	struct pollfd fd[2];
+	struct pollfd fd[3];
 
-	fd[0].fd     = xs_.fileno();
+	fd[0].fd     = xc_.evtchnFd( xce_ );
 	fd[0].events = POLLIN | POLLERR;
-	fd[1].fd     = xc_.evtchnFd( xce_ );
+	fd[1].fd     = wakeFd_;
 	fd[1].events = POLLIN | POLLERR;
+	fd[2].fd     = timerFd_;
+	fd[2].events = POLLIN | POLLERR;
 
-	int rc = poll( fd, 2, ms );
+	struct pollfd &wakeup = fd[1];
+	struct pollfd &timer  = fd[2];
+
+	int rc = poll( fd, 3, ms );
 #else
-	struct pollfd fd[1];
+	struct pollfd fd[2];
 
-	fd[0].fd     = xs_.fileno();
+	fd[0].fd     = wakeFd_;
 	fd[0].events = POLLIN | POLLERR;
+	fd[1].fd     = timerFd_;
+	fd[1].events = POLLIN | POLLERR;
+
+	struct pollfd &wakeup = fd[0];
+	struct pollfd &timer  = fd[1];
 
-	int rc = poll( fd, 1, ms );
+	int rc = poll( fd, 2, ms );
 #endif
 
 	if ( rc == 0 ) // poll() timeout
@@ -876,59 +2214,21 @@ int XenEventManager::waitForEventOrTimeout( int ms )
 		throw std::runtime_error( "[Xen events] poll() failed" );
 	}
 
-	if ( fd[0].revents & POLLIN ) { // a XenStore event
-		std::vector<std::string> vec;
-
-		if ( xs_.readWatch( vec ) && vec[XS::watchToken] == watchToken_ ) {
-			/* Our domain is being shut down */
-			if ( vec[XS::watchPath] == watchToken_ ) {
-				if ( firstReleaseWatch_ ) {
-					// Ignore first triggered watch, xs_watch() does that.
-					firstReleaseWatch_ = false;
-				} else {
-					xs_transaction_t         th = xs_.transactionStart();
-					std::vector<std::string> dir;
+	if ( wakeup.revents & POLLIN ) { // somebody posted a command, dispatchEvents() will run it
+		eventfd_t value;
 
-					if ( !xs_.directory( th, vec[XS::watchPath], dir ) ) {
-						guestState_ = ( xs_.isDomainIntroduced( domain_ ) != 0 ) ?
-							RUNNING : SHUTDOWN_IN_PROGRESS;
-						stop();
-					}
+		eventfd_read( wakeFd_, &value );
+	}
 
-					xs_.transactionEnd( th, 0 );
-				}
-			} else if ( vec[XS::watchPath] == controlXenStorePath_ ) {
-				if ( firstControlCommand_ ) {
-					// Ignore first triggered watch, xs_watch() does that.
-					firstControlCommand_ = false;
-				} else {
-					CUniquePtr<char> value(
-					        xs_.readTimeout( XS::xbtNull, vec[XS::watchPath], nullptr, 1 ) );
-
-					if ( value ) {
-						std::string tmp = value.get();
-
-						logger << INFO << "Received control command: " << tmp << std::flush;
-
-						if ( tmp == "shutdown" ) {
-							guestState_ = RUNNING;
-							stop();
-						}
-					}
-				}
-			} else if ( vec[XS::watchPath] == "@releaseDomain" ) {
-				if ( !xs_.isDomainIntroduced( domain_ ) ) {
-					guestState_ = POST_SHUTDOWN;
-					stop();
-				}
-			}
+	if ( timer.revents & POLLIN ) { // a timer is due, runTimers() will take care of it
+		uint64_t expirations;
 
-			return 0;
-		}
+		if ( read( timerFd_, &expirations, sizeof( expirations ) ) < 0 && errno != EAGAIN )
+			logger << ERROR << "[Xen events] could not read the timerfd: " << strerror( errno ) << std::flush;
 	}
 
 #ifndef DISABLE_MEM_EVENT
-	if ( fd[1].revents & POLLIN ) { // a vm_event
+	if ( fd[0].revents & POLLIN ) { // a vm_event
 		int port = xc_.evtchnPending( xce_ );
 
 		if ( port == -1 )
@@ -941,37 +2241,229 @@ int XenEventManager::waitForEventOrTimeout( int ms )
 	}
 #endif
 
+	if ( ( wakeup.revents | timer.revents ) & POLLIN )
+		return 0;
+
 	// shouldn't be here
 	throw std::runtime_error( "[Xen events] error getting event" );
 }
 
-template <typename Request, typename Ring> void XenEventManager::getRequest( Request &req )
+void XenEventManager::watchXenStore()
+{
+	struct pollfd fd[2];
+
+	fd[0].fd     = xs_.fileno();
+	fd[0].events = POLLIN | POLLERR;
+	fd[1].fd     = xsStopFd_;
+	fd[1].events = POLLIN | POLLERR;
+
+	for ( ;; ) {
+		int rc = poll( fd, 2, -1 );
+
+		if ( rc < 0 ) {
+			if ( errno == EINTR )
+				continue;
+
+			logger << ERROR << "[Xen events] XenStore poll() failed: " << strerror( errno ) << std::flush;
+			return;
+		}
+
+		if ( fd[1].revents & POLLIN )
+			return;
+
+		if ( fd[0].revents & POLLIN ) {
+			try {
+				handleXenStoreWatch();
+			} catch ( const std::exception &e ) {
+				logger << ERROR << e.what() << std::flush;
+			}
+		}
+	}
+}
+
+void XenEventManager::handleXenStoreWatch()
+{
+	std::vector<std::string> vec;
+
+	if ( !xs_.readWatch( vec ) || vec[XS::watchToken] != watchToken_ )
+		return;
+
+	/* Our domain is being shut down */
+	if ( vec[XS::watchPath] == watchToken_ ) {
+		if ( firstReleaseWatch_ ) {
+			// Ignore first triggered watch, xs_watch() does that.
+			firstReleaseWatch_ = false;
+		} else {
+			xs_transaction_t         th = xs_.transactionStart();
+			std::vector<std::string> dir;
+
+			if ( !xs_.directory( th, vec[XS::watchPath], dir ) )
+				postStop( ( xs_.isDomainIntroduced( domain_ ) != 0 ) ? RUNNING : SHUTDOWN_IN_PROGRESS );
+
+			xs_.transactionEnd( th, 0 );
+		}
+	} else if ( vec[XS::watchPath] == controlXenStorePath_ ) {
+		if ( firstControlCommand_ ) {
+			// Ignore first triggered watch, xs_watch() does that.
+			firstControlCommand_ = false;
+		} else {
+			CUniquePtr<char> value( xs_.readTimeout( XS::xbtNull, vec[XS::watchPath], nullptr, 1 ) );
+
+			if ( value ) {
+				std::string tmp = value.get();
+
+				logger << INFO << "Received control command: " << tmp << std::flush;
+
+				if ( tmp == "shutdown" )
+					postStop( RUNNING );
+			}
+		}
+	} else if ( vec[XS::watchPath] == "@releaseDomain" ) {
+		if ( !xs_.isDomainIntroduced( domain_ ) )
+			postStop( POST_SHUTDOWN );
+	}
+}
+
+void XenEventManager::stopXenStoreWatcher()
 {
-	Ring *      backRing   = static_cast<Ring *>( backRing_ );
-	RING_IDX    reqCons    = backRing->req_cons;
-	const void *ringReqPtr = RING_GET_REQUEST( backRing, reqCons );
+	if ( !xsThread_.joinable() )
+		return;
+
+	if ( eventfd_write( xsStopFd_, 1 ) < 0 ) {
+		logger << ERROR << "[Xen events] could not stop the XenStore thread: " << strerror( errno ) << std::flush;
+		xsThread_.detach();
+		return;
+	}
+
+	xsThread_.join();
+}
+
+void XenEventManager::postStop( GuestState state )
+{
+	postCommand( [this, state]() {
+		guestState_ = state;
+
+		try {
+			stop();
+		} catch ( const std::exception &e ) {
+			logger << ERROR << e.what() << std::flush;
+		}
+	} );
+}
+
+template <typename Request, typename Ring> const Request &XenEventManager::getRequest()
+{
+	Ring *         backRing = static_cast<Ring *>( backRing_ );
+	RING_IDX       reqCons  = backRing->req_cons;
+	const Request &req      = *reinterpret_cast<const Request *>( RING_GET_REQUEST( backRing, reqCons ) );
 
-	/* Copy request */
-	memcpy( &req, ringReqPtr, sizeof( req ) );
 	++reqCons;
 
-	/* Update ring */
+	/* Update ring. Xen can't reuse the slot before it has seen our response. */
 	backRing->req_cons         = reqCons;
 	backRing->sring->req_event = reqCons + 1;
+
+	return req;
+}
+
+void XenEventManager::initResponseTemplates()
+{
+	// Xen 4.6 can't take registers or an instruction skip in a response
+	canSetRegisters_     = xc_.version != Version( 4, 6 ) || xc_.isXenServer;
+	canGetNextInterrupt_ = xc_.version >= Version( 4, 9 ) || xc_.isXenServer;
+	canFastSinglestep_   = vmEventInterfaceVersion_ >= 6; // u.fast_singlestep is new in v6
+	canSetEmulInsnData_  = xc_.version >= Version( 4, 8 ) || xc_.isXenServer;
+
+	responseTemplates_.fill( ResponseTemplate() );
+
+	ResponseTemplate &memAccess = responseTemplates_[VM_EVENT_REASON_MEM_ACCESS];
+
+	memAccess.flags = VM_EVENT_FLAG_EMULATE;
+	memAccess.copy  = ResponseTemplate::MEM_ACCESS;
+
+	responseTemplates_[VM_EVENT_REASON_WRITE_CTRLREG].copy = ResponseTemplate::CTRLREG_INDEX;
+
+	responseTemplates_[VM_EVENT_REASON_SINGLESTEP].flags =
+	        VM_EVENT_FLAG_ALTERNATE_P2M | VM_EVENT_FLAG_TOGGLE_SINGLESTEP;
+}
+
+template <typename Request, typename Response>
+void XenEventManager::initResponse( const Request &req, Response &rsp ) const
+{
+	static const ResponseTemplate none;
+
+	const ResponseTemplate &tpl = req.reason < responseTemplates_.size() ? responseTemplates_[req.reason] : none;
+
+	rsp.version    = req.version;
+	rsp.vcpu_id    = req.vcpu_id;
+	rsp.flags      = ( req.flags & ~VM_EVENT_FLAG_ALTERNATE_P2M ) | tpl.flags;
+	rsp.reason     = req.reason;
+	rsp.altp2m_idx = req.altp2m_idx;
+
+	memset( &rsp.u, 0, sizeof( rsp.u ) );
+
+	switch ( tpl.copy ) {
+		case ResponseTemplate::MEM_ACCESS:
+			rsp.u.mem_access.gfn   = req.u.mem_access.gfn;
+			rsp.u.mem_access.flags = req.u.mem_access.flags;
+			break;
+		case ResponseTemplate::CTRLREG_INDEX:
+			rsp.u.write_ctrlreg.index = req.u.write_ctrlreg.index;
+			break;
+		default:
+			break;
+	}
 }
 
 template <typename Response, typename Ring> void XenEventManager::putResponse( const Response &rsp )
 {
 	Ring *   backRing = static_cast<Ring *>( backRing_ );
 	RING_IDX rspProd  = backRing->rsp_prod_pvt;
+	Response *slot    = reinterpret_cast<Response *>( RING_GET_RESPONSE( backRing, rspProd ) );
+
+	/*
+	 * Write the response. The slot is normally the one the request came in, so this is the point
+	 * where the request gets overwritten. Xen only looks at the data union if one of these flags
+	 * says so, otherwise it's not worth copying.
+	 */
+	slot->version    = rsp.version;
+	slot->flags      = rsp.flags;
+	slot->reason     = rsp.reason;
+	slot->vcpu_id    = rsp.vcpu_id;
+	slot->altp2m_idx = rsp.altp2m_idx;
+
+	memcpy( &slot->u, &rsp.u, sizeof( rsp.u ) );
+
+	if ( rsp.flags &
+	     ( VM_EVENT_FLAG_SET_REGISTERS | VM_EVENT_FLAG_SET_EMUL_READ_DATA | VM_EVENT_FLAG_SET_EMUL_INSN_DATA ) )
+		memcpy( &slot->data, &rsp.data, sizeof( rsp.data ) );
 
-	/* Copy response */
-	memcpy( RING_GET_RESPONSE( backRing, rspProd ), &rsp, sizeof( rsp ) );
 	++rspProd;
 
-	/* Update ring */
+	/* Update ring (Xen won't see it until pushResponses()) */
 	backRing->rsp_prod_pvt = rspProd;
-	RING_PUSH_RESPONSES( backRing );
+	++unpushedResponses_;
+}
+
+template <typename Ring> void XenEventManager::pushResponses()
+{
+	if ( !unpushedResponses_ )
+		return;
+
+	RING_PUSH_RESPONSES( static_cast<Ring *>( backRing_ ) );
+	unpushedResponses_ = 0;
+
+	resumePage();
+}
+
+bool XenEventManager::setEventBatching( unsigned int maxBatch, unsigned int maxLatencyUs )
+{
+	// Only the event loop reads them
+	return runOnEventThread( [this, maxBatch, maxLatencyUs]() {
+		maxBatch_        = maxBatch ? maxBatch : 1;
+		maxBatchLatency_ = std::chrono::microseconds( maxLatencyUs );
+		return true;
+	} );
 }
 
 void XenEventManager::resumePage()
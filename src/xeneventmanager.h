@@ -18,10 +18,20 @@
 
 #include "bdvmi/eventhandler.h"
 #include "bdvmi/eventmanager.h"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
 #include <stdint.h>
 #include <string>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 
 extern "C" {
 #define private rprivate /* private is a C++ keyword */
@@ -29,12 +39,15 @@ extern "C" {
 #undef private
 }
 
+#include "mpscqueue.h"
 #include "xcwrapper.h"
 #include "xswrapper.h"
 
 namespace bdvmi {
 
 class XenDriver;
+class RegisterView;
+struct Event;
 
 class XenEventManager : public EventManager {
 
@@ -50,6 +63,59 @@ public:
 	// Stop the event loop
 	void stop() override;
 
+	bool setEventBatching( unsigned int maxBatch, unsigned int maxLatencyUs ) override;
+
+	bool setParallelDispatch( unsigned int workers ) override;
+
+	std::vector<int> descriptors() const override;
+
+	bool processEvents() override;
+
+	bool setBusyPoll( unsigned int spinUs ) override;
+
+	BusyPollStats busyPollStats() const override;
+
+	unsigned int addTimer( std::chrono::milliseconds period, std::chrono::microseconds budget,
+	                       TimerCallback callback ) override;
+
+	bool removeTimer( unsigned int id ) override;
+
+	bool deferResponse( unsigned short vcpu, ResponseToken &token ) override;
+
+	bool completeResponse( ResponseToken token, HVAction action, const EmulatorContext *emulatorCtx = nullptr,
+	                       unsigned short instructionSize = 0 ) override;
+
+private:
+	struct ResponseTemplate {
+		enum Copy { NOTHING, MEM_ACCESS, CTRLREG_INDEX }; // request fields that go back in the union
+
+		uint32_t flags{ 0 };
+		Copy     copy{ NOTHING };
+	};
+
+	struct Timer {
+		std::chrono::steady_clock::time_point due;
+		std::chrono::milliseconds             period;
+		std::chrono::microseconds             budget;
+		TimerCallback                         callback;
+	};
+
+	// Heap entry, stale once the timer is gone or has been rescheduled
+	struct TimerDue {
+		std::chrono::steady_clock::time_point due;
+		unsigned int                          id;
+
+		bool operator>( const TimerDue &other ) const
+		{
+			return due > other.due;
+		}
+	};
+
+	struct QueuedRequest;
+	struct DispatchWorker;
+	struct ParkedResponse;
+	struct EventThreadScope;
+
 private:
 	bool enableMsrEventsImpl( unsigned int msr ) override;
 
@@ -59,6 +125,8 @@ private:
 
 	bool disableCrEventsImpl( unsigned int cr ) override;
 
+	bool enableCrEventsImpl( unsigned int cr, uint64_t watchedBits, bool sync, bool onChangeOnly ) override;
+
 	bool enableXSETBVEventsImpl() override;
 
 	bool disableXSETBVEventsImpl() override;
@@ -78,41 +146,165 @@ private:
 private:
 	void initXenStore();
 
+	// Run fn on the event thread and wait for its result. Runs it right away if this is the event thread,
+	// or, as the event thread, if no thread is in the event loop.
+	template <typename Fn> bool runOnEventThread( Fn fn );
+
+	// Hand command to the event thread, without waiting for it
+	void postCommand( std::function<void()> command );
+
+	// Become the event thread, waiting for whoever is it now. With handOff, give up (false) as soon
+	// as a loop is running instead: posted commands get run by the loop.
+	bool acquireEventThread( bool loop, bool handOff );
+
+	// Run what's been posted and let the next one in
+	void releaseEventThread( bool loop );
+
+	void runCommands();
+
+	// Event thread only: block until done(), running posted commands in the meantime
+	template <typename Done> void waitServingCommands( Done done );
+
+	// Get the event loop out of poll()
+	void wake();
+
 	void initEventChannels();
 
 	void initMemAccess();
 
 	int waitForEventOrTimeout( int ms );
 
-	template <typename Request, typename Ring> void getRequest( Request &req );
+	// XenStore watches are served on a thread of their own, so a slow xenstored can't hold up the ring.
+	// All it does to the event loop is post a stop.
+	void watchXenStore();
+
+	void handleXenStoreWatch();
+
+	void stopXenStoreWatcher();
+
+	// Have the event thread record the guest's state and stop
+	void postStop( GuestState state );
+
+	// Requests waiting on the ring
+	template <typename Ring> bool requestsPending() const;
+
+	// Run the timers that are due, unless there are requests to answer
+	template <typename Ring> void runTimers();
+
+	// Point the timerfd at the earliest deadline, with timersMutex_ held
+	void armTimerFd();
+
+	// Spin until Xen has put a new request on the ring or the busy-poll budget runs out
+	template <typename Ring> bool spinForRequests();
+
+	// The returned request lives in the ring slot, valid until its response is written by putResponse()
+	template <typename Request, typename Ring> const Request &getRequest();
+
+	// What every response to a given reason starts out with, and which Xen features responses can use.
+	// Worked out once, so that initResponse() only has to patch in the per-request fields.
+	void initResponseTemplates();
+
+	template <typename Request, typename Response> void initResponse( const Request &req, Response &rsp ) const;
 
 	template <typename Response, typename Ring> void putResponse( const Response &rsp );
 
+	// Make the responses written so far visible to Xen and notify it, if there are any
+	template <typename Ring> void pushResponses();
+
 	void resumePage();
 
 	std::string uuid() override;
 
 	void cleanup();
 
-	template <typename Response> void setRegisters( Response &rsp );
+	template <typename Request, typename Response> void setRegisters( const Request &req, Response &rsp );
+
+	template <typename Request, typename Response>
+	static void prepareSetRegisters( const Request &req, Response &rsp );
 
-	bool setCrEvents( unsigned int cr, bool enable );
+	// ignoredBits: changes to these bits alone don't cause an event
+	bool setCrEvents( unsigned int cr, bool enable, uint64_t ignoredBits, bool sync, bool onChangeOnly );
 
 	uint64_t getMsr( unsigned short vcpu, uint32_t msr ) const;
 
 	template <typename Request, typename Response, typename Ring> void waitForEventsByVMEventVersion();
 
+	template <typename Request, typename Response, typename Ring> bool processEventsByVMEventVersion();
+
+	// One pass over XenStore / the ring, false once the event manager has stopped
+	template <typename Request, typename Response, typename Ring> bool dispatchEvents( bool &busy );
+
+	// Answer whatever is still in flight once the event sources are off, until the ring has been quiet
+	// for a few milliseconds
+	void drainEvents();
+
+	template <typename Request, typename Response, typename Ring> void drainEventsByVMEventVersion();
+
+	// Everything between taking a request off the ring and putting its response back. Returns false
+	// if the response has been deferred or already put back, in which case there's nothing left to do.
+	template <typename Request, typename Response, typename Ring>
+	bool processRequest( const Request &req, Response &rsp );
+
+	// Show the handler an event the vcpu isn't waiting on, nothing it decides is acted upon
+	template <typename Request, typename Response> void notifyAsync( const Request &req );
+
+	// Everything pending on the ring, for handlers that take their events in batches
+	template <typename Request, typename Response>
+	void processBatch( const std::vector<Request> &reqs, std::vector<Response> &rsps );
+
+	// Turn the handler's decision into response flags
 	template <typename Request, typename Response>
-	void handleMemAccess( const Request &req, Response &rsp, bool &skip );
+	void applyAction( const Request &req, Response &rsp, HVAction action, const EmulatorContext &emulatorCtx,
+	                  unsigned short instructionSize, bool &skip );
 
-	template <typename Request, typename Response> void handleCrWrite( const Request &req, Response &rsp );
+	// Pending injections and register writes, the last things to go into a response
+	template <typename Request, typename Response> void finishResponse( const Request &req, Response &rsp, bool skip );
 
-	template <typename Request, typename Response> void handleMsrWrite( const Request &req, Response &rsp );
+	// The view ALLOW_SINGLESTEP steps instructions in, created the first time it's needed
+	bool singlestepView( unsigned short &view );
 
+	void releaseSinglestepView();
+
+	// Keep a copy of the request and response until completeResponse(), returns false if that already happened
 	template <typename Request, typename Response>
-	void handleDescriptorWrite( const Request &req, Response &rsp, bool &skip );
+	bool parkResponse( ResponseToken token, const Request &req, Response &rsp, bool &skip );
+
+	template <typename Request, typename Response, typename Ring> void completeParked( const ParkedResponse &parked );
+
+	// Respond to whatever is still parked, the vcpus can't be left paused
+	void releaseParkedResponses();
+
+	template <typename Request, typename Response, typename Ring> void startWorkers();
+
+	void stopWorkers();
+
+	void enqueueRequest( DispatchWorker &worker, const QueuedRequest &item );
+
+	template <typename Request, typename Response, typename Ring> void runWorker( DispatchWorker &worker );
+
+	// Fill in event from req and the response flags that don't depend on the handler, returns
+	// the handler to deliver it to (nullptr: nobody wants it)
+	template <typename Request, typename Response>
+	EventHandler *prepareEvent( const Request &req, Response &rsp, const RegisterView &regs, Event &event );
+
+	// Act on what the handler decided
+	template <typename Request, typename Response>
+	void concludeEvent( const Request &req, Response &rsp, Event &event, bool &skip );
+
+	template <typename Request> void prepareMemAccess( const Request &req, Event &event );
+
+	// Count an EPT violation towards the hot page stats, whether or not anybody handles page faults
+	template <typename Request> void trackPageFault( const Request &req, const Event &event );
+
+	void relaxHotPage( uint64_t gpa, unsigned short view, bool read, bool write, bool execute );
+
+	template <typename Request> void prepareCrWrite( const Request &req, Event &event );
+
+	template <typename Request> void prepareMsrWrite( const Request &req, Event &event );
+
+	template <typename Request> void prepareDescriptorAccess( const Request &req, Event &event );
 
-	template <typename Request> void handleBreakpoint( const Request &req );
+	template <typename Request> void reinjectBreakpoint( const Request &req );
 
 public:
 	// Don't allow copying for these objects
@@ -125,7 +317,6 @@ private:
 	XenDriver & driver_;
 	XC &        xc_;
 	domid_t     domain_;
-	bool        stop_{ false };
 	xc_evtchn * xce_{ nullptr };
 	int         port_{ -1 };
 	XS          xs_;
@@ -139,13 +330,62 @@ private:
 	bool        evtchnBindOn_{ false };
 	bool        firstReleaseWatch_{ true };
 	bool        firstControlCommand_{ true };
-	bool        foundEvents_{ false };
 	uint32_t    vmEventInterfaceVersion_{ 0 };
 	GuestState  guestState_{ RUNNING };
+	bool        canSetRegisters_{ false };
+	bool        canGetNextInterrupt_{ false };
+	bool        canFastSinglestep_{ false };
+	bool        canSetEmulInsnData_{ false };
+	std::once_flag singlestepOnce_;
+	unsigned short singlestepView_{ 0 };
+	bool           singlestepReady_{ false };
+	std::unordered_map<unsigned short, uint16_t> singlestepReturnView_; // by vcpu, while a step is armed
+	std::mutex                                   singlestepMutex_;
+	std::array<ResponseTemplate, 16> responseTemplates_; // by VM_EVENT_REASON_*
+	unsigned int              maxBatch_{ 1 };
+	std::chrono::microseconds maxBatchLatency_{ 0 };
+	unsigned int              unpushedResponses_{ 0 };
+	std::chrono::microseconds spinBudget_{ 0 };
+	std::atomic<uint64_t>     spins_{ 0 };
+	std::atomic<uint64_t>     spinHits_{ 0 };
+	std::atomic<uint64_t>     sleeps_{ 0 };
 
 	using msrs_values_map_t = std::unordered_map<uint32_t, uint64_t>;
 	using vcpu_msrs_t       = std::unordered_map<unsigned short, msrs_values_map_t>;
 	vcpu_msrs_t msrOldValueCache_;
+	std::mutex  msrOldValueCacheMutex_;
+
+	// Set by stop(), from whatever thread
+	std::atomic<bool> stop_{ false };
+
+	// Parallel dispatch: requests from vcpu N go to workers_[N % workers_.size()]
+	unsigned int                                 workerCount_{ 0 };
+	std::vector<std::unique_ptr<DispatchWorker>> workers_;
+	std::mutex                                   ringMutex_;
+
+	// Work for the event thread, posted from the others
+	int                              wakeFd_{ -1 };
+	int                              xsStopFd_{ -1 };
+	std::thread                      xsThread_;
+
+	// Timers, run on the event thread but added and removed from anywhere
+	int                                                                          timerFd_{ -1 };
+	std::unordered_map<unsigned int, Timer>                                      timers_;
+	std::priority_queue<TimerDue, std::vector<TimerDue>, std::greater<TimerDue>> timerQueue_;
+	std::mutex                                                                   timersMutex_;
+	std::atomic<unsigned int>                                                    lastTimerId_{ 0 };
+	MPSCQueue<std::function<void()>> commands_;
+	std::mutex                       eventThreadMutex_; // guards eventThreadBusy_, and loopRunning_ changes
+	std::condition_variable          eventThreadCv_;
+	bool                             eventThreadBusy_{ false }; // some thread is acting as the event thread
+	std::atomic<bool>                loopRunning_{ false };
+	std::mutex                       serveMutex_; // for waitServingCommands()
+	std::condition_variable          serveCv_;
+
+	// Deferred responses, by token
+	std::unordered_map<ResponseToken, std::unique_ptr<ParkedResponse>> parked_;
+	ResponseToken                                                       lastToken_{ 0 };
+	std::mutex                                                          parkedMutex_;
 
 #ifdef DEBUG_DUMP_EVENTS
 	std::ofstream eventsFile_;